@@ -0,0 +1,249 @@
+#include "gin.h"
+#include <benchmark/benchmark.h>
+
+#ifndef _WIN32
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+// 每个用例持续压测的时间
+constexpr auto Duration = std::chrono::seconds(2);
+
+const char Request[] = "GET /hello/bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+// 在自己的线程和事件循环上运行的服务器, 监听 127.0.0.1 的随机端口
+struct server_s
+{
+    Engine engine;
+    uv_loop_s loop;
+    uv_http_s http;
+    uv_async_s stop;
+    uv_thread_t thread;
+    int port = 0;
+
+    auto start(Execution execution) -> int
+    {
+        engine.handle(
+            "GET", "/hello/:name",
+            [](request_s *, response_s *res, Context *)
+            {
+                res->setStatus(200)
+                    ->addHeader("Content-Type", "text/plain")
+                    ->setBody("Hello, bench!");
+            },
+            execution);
+
+        uv_loop_init(&loop);
+        int err = uv_http_init(&http, &loop, &engine);
+        if (!err)
+        {
+            // 每个连接一直压测到结束, 不限制请求数
+            uv_http_keepalive(&http, 5000, 0);
+            err = uv_http_listen(&http, "127.0.0.1", 0);
+        }
+        if (err)
+        {
+            return err;
+        }
+
+        struct sockaddr_in addr;
+        int len = sizeof(addr);
+        uv_tcp_getsockname(&http.server, (struct sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+
+        stop.data = &http;
+        uv_async_init(&loop, &stop,
+                      [](uv_async_t *handle)
+                      {
+                          uv_http_stop(static_cast<uv_http_s *>(handle->data));
+                          uv_close((uv_handle_t *)handle, nullptr);
+                      });
+        return uv_thread_create(
+            &thread, [](void *arg)
+            { uv_run(static_cast<uv_loop_s *>(arg), UV_RUN_DEFAULT); },
+            &loop);
+    }
+
+    void shutdown()
+    {
+        uv_async_send(&stop);
+        uv_thread_join(&thread);
+        uv_loop_close(&loop);
+    }
+};
+
+// 一个 keep-alive 连接, 发出请求后等待完整的响应再发下一个
+struct client_s
+{
+    int fd = -1;
+    std::string buf;
+    std::vector<uint64_t> latencies;
+    uint64_t errors = 0;
+
+    auto connect(int port) -> bool
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return ::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+
+    // 读到一个完整的响应, 连接出错时返回 false
+    auto readResponse() -> bool
+    {
+        size_t end;
+        while ((end = buf.find("\r\n\r\n")) == std::string::npos)
+        {
+            if (!fill())
+            {
+                return false;
+            }
+        }
+
+        size_t length = 0;
+        size_t pos = buf.find("Content-Length: ");
+        if (pos != std::string::npos && pos < end)
+        {
+            length = strtoul(buf.c_str() + pos + 16, nullptr, 10);
+        }
+        while (buf.size() < end + 4 + length)
+        {
+            if (!fill())
+            {
+                return false;
+            }
+        }
+        bool ok = buf.compare(0, 12, "HTTP/1.1 200") == 0;
+        buf.erase(0, end + 4 + length);
+        return ok;
+    }
+
+    auto fill() -> bool
+    {
+        char data[4096];
+        ssize_t n = recv(fd, data, sizeof(data), 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        buf.append(data, n);
+        return true;
+    }
+
+    void run(int port, std::chrono::steady_clock::time_point deadline)
+    {
+        if (!connect(port))
+        {
+            errors++;
+            return;
+        }
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (send(fd, Request, sizeof(Request) - 1, MSG_NOSIGNAL) < 0)
+            {
+                errors++;
+                break;
+            }
+            if (!readResponse())
+            {
+                errors++;
+                break;
+            }
+            latencies.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count());
+        }
+        close(fd);
+    }
+};
+
+// 排好序的延迟中第 q 分位, 微秒
+auto percentile(const std::vector<uint64_t> &sorted, double q) -> double
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = std::min(sorted.size() - 1,
+                        static_cast<size_t>(q * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+// 在同一进程中启动服务器和 state.range(0) 个压测连接, 统计吞吐量和延迟分布
+void loopback(benchmark::State &state, Execution execution)
+{
+    server_s server;
+    int err = server.start(execution);
+    if (err)
+    {
+        state.SkipWithError(uv_strerror(err));
+        return;
+    }
+
+    std::vector<uint64_t> latencies;
+    uint64_t errors = 0;
+    for (auto _ : state)
+    {
+        std::vector<client_s> clients(state.range(0));
+        std::vector<std::thread> threads;
+        auto deadline = std::chrono::steady_clock::now() + Duration;
+        for (auto &client : clients)
+        {
+            threads.emplace_back([&client, &server, deadline]()
+                                 { client.run(server.port, deadline); });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        for (auto &client : clients)
+        {
+            latencies.insert(latencies.end(), client.latencies.begin(),
+                             client.latencies.end());
+            errors += client.errors;
+        }
+    }
+    server.shutdown();
+
+    std::sort(latencies.begin(), latencies.end());
+    state.counters["req/s"] =
+        benchmark::Counter(latencies.size(), benchmark::Counter::kIsRate);
+    state.counters["p50_us"] = percentile(latencies, 0.5);
+    state.counters["p99_us"] = percentile(latencies, 0.99);
+    state.counters["p999_us"] = percentile(latencies, 0.999);
+    state.counters["errors"] = errors;
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(loopback, threadpool, Execution::ThreadPool)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(64)
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(loopback, inline, Execution::Inline)
+    ->Arg(1)
+    ->Arg(16)
+    ->Arg(64)
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+#endif
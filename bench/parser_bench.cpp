@@ -0,0 +1,159 @@
+#include "ctx.h"
+#include "llhttp.h"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <string>
+
+namespace
+{
+
+// 和 gin.cpp 中的解析回调相同的做法: 各字段追加到容量固定的 head,
+// 请求中的 string_view 指向 head
+struct parse_s
+{
+    llhttp_t parser;
+    std::string head;
+    size_t mark = 0;
+    std::string_view field;
+    request_s request;
+    size_t messages = 0;
+};
+
+auto state(llhttp_t *parser) -> parse_s *
+{
+    return static_cast<parse_s *>(parser->data);
+}
+
+auto onspan(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    state(parser)->head.append(at, length);
+    return 0;
+}
+
+auto spancomplete(parse_s *s) -> std::string_view
+{
+    std::string_view span(s->head.data() + s->mark, s->head.size() - s->mark);
+    s->mark = s->head.size();
+    return span;
+}
+
+auto onmessagebegin(llhttp_t *parser) -> int
+{
+    parse_s *s = state(parser);
+    s->head.clear();
+    s->mark = 0;
+    s->request.reset();
+    return 0;
+}
+
+auto onurlcomplete(llhttp_t *parser) -> int
+{
+    state(parser)->request.url = spancomplete(state(parser));
+    return 0;
+}
+
+auto onmethodcomplete(llhttp_t *parser) -> int
+{
+    state(parser)->request.method = spancomplete(state(parser));
+    return 0;
+}
+
+auto onversioncomplete(llhttp_t *parser) -> int
+{
+    state(parser)->request.version = spancomplete(state(parser));
+    return 0;
+}
+
+auto onheaderfieldcomplete(llhttp_t *parser) -> int
+{
+    state(parser)->field = spancomplete(state(parser));
+    return 0;
+}
+
+auto onheadervaluecomplete(llhttp_t *parser) -> int
+{
+    parse_s *s = state(parser);
+    s->request.headers.add(s->field, spancomplete(s));
+    return 0;
+}
+
+auto onmessagecomplete(llhttp_t *parser) -> int
+{
+    state(parser)->messages++;
+    return 0;
+}
+
+// 浏览器发出的典型 GET 请求
+const char Browser[] =
+    "GET /repos/mviruch/libgin/issues?state=open&page=2 HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://example.com/mviruch/libgin\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=7d3f0c2a9b8e4f61a5c2d9e0b7a4f318; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+// 压测工具发出的最小请求
+const char Minimal[] = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+void parseRequest(benchmark::State &st, const char *data, size_t size,
+                  size_t pipeline, size_t chunk)
+{
+    llhttp_settings_t settings;
+    llhttp_settings_init(&settings);
+    settings.on_message_begin = onmessagebegin;
+    settings.on_url = onspan;
+    settings.on_method = onspan;
+    settings.on_version = onspan;
+    settings.on_header_field = onspan;
+    settings.on_header_value = onspan;
+    settings.on_url_complete = onurlcomplete;
+    settings.on_method_complete = onmethodcomplete;
+    settings.on_version_complete = onversioncomplete;
+    settings.on_header_field_complete = onheaderfieldcomplete;
+    settings.on_header_value_complete = onheadervaluecomplete;
+    settings.on_message_complete = onmessagecomplete;
+
+    parse_s s;
+    s.head.reserve(8192);
+    llhttp_init(&s.parser, HTTP_REQUEST, &settings);
+    s.parser.data = &s;
+
+    // 流水线的多个请求在同一次读取中到达
+    std::string input;
+    for (size_t i = 0; i < pipeline; i++)
+    {
+        input.append(data, size);
+    }
+    chunk = chunk == 0 ? input.size() : chunk;
+
+    for (auto _ : st)
+    {
+        // 一次读取可能只到达请求的一部分, 字段分段回调
+        for (size_t off = 0; off < input.size(); off += chunk)
+        {
+            llhttp_execute(&s.parser, input.data() + off,
+                           std::min(chunk, input.size() - off));
+        }
+        benchmark::DoNotOptimize(s.request.headers.size());
+    }
+    if (s.messages != st.iterations() * pipeline)
+    {
+        st.SkipWithError("parse error");
+    }
+    st.SetItemsProcessed(st.iterations() * pipeline);
+    st.SetBytesProcessed(st.iterations() * input.size());
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(parseRequest, minimal, Minimal, sizeof(Minimal) - 1, 1, 0);
+BENCHMARK_CAPTURE(parseRequest, browser, Browser, sizeof(Browser) - 1, 1, 0);
+BENCHMARK_CAPTURE(parseRequest, browser_split, Browser, sizeof(Browser) - 1, 1, 64);
+BENCHMARK_CAPTURE(parseRequest, minimal_pipeline16, Minimal, sizeof(Minimal) - 1, 16, 0);
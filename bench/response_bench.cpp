@@ -0,0 +1,86 @@
+#include "ctx.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <unordered_map>
+
+namespace
+{
+
+// 典型的 JSON 响应头
+const std::pair<const char *, const char *> Headers[] = {
+    {"Content-Type", "application/json; charset=utf-8"},
+    {"Cache-Control", "no-cache"},
+    {"X-Request-Id", "5f2b8c1e-93a4-4d0b-b6e2-7c1d9a3f0e42"},
+    {"Content-Length", "512"},
+};
+
+// 之前用 sprintf 和 std::to_string 拼接的做法, 作为对照
+void sprintfHead(const std::string &version, int code,
+                 const std::string &message,
+                 const std::unordered_map<std::string, std::string> &headers,
+                 std::string &out)
+{
+    size_t total = version.size() + 1 + std::to_string(code).size() + 1 +
+                   message.size() + 2 + 2;
+    for (const auto &[key, value] : headers)
+    {
+        total += key.size() + 2 + value.size() + 2;
+    }
+
+    size_t start = out.size();
+    out.resize(start + total + 1);
+    char *p = &out[start];
+    p += std::sprintf(p, "%s %d %s\r\n", version.c_str(), code,
+                      message.c_str());
+    for (const auto &[key, value] : headers)
+    {
+        p += std::sprintf(p, "%s: %s\r\n", key.c_str(), value.c_str());
+    }
+    std::sprintf(p, "\r\n");
+    out.resize(start + total);
+}
+
+void buildHead(benchmark::State &state, int code, const char *message)
+{
+    response_s res;
+    res.setStatus(code, message);
+    for (const auto &[key, value] : Headers)
+    {
+        res.addHeader(key, value);
+    }
+
+    std::string out;
+    for (auto _ : state)
+    {
+        out.clear();
+        res.buildHead(out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+
+void buildHeadSprintf(benchmark::State &state, int code, const char *message)
+{
+    std::unordered_map<std::string, std::string> headers;
+    for (const auto &[key, value] : Headers)
+    {
+        headers[key] = value;
+    }
+
+    std::string version = "HTTP/1.1";
+    std::string reason = message;
+    std::string out;
+    for (auto _ : state)
+    {
+        out.clear();
+        sprintfHead(version, code, reason, headers, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(buildHead, ok, 200, "");
+BENCHMARK_CAPTURE(buildHead, not_found, 404, "");
+BENCHMARK_CAPTURE(buildHead, custom_message, 200, "Fine");
+BENCHMARK_CAPTURE(buildHeadSprintf, ok, 200, "OK");
+BENCHMARK_CAPTURE(buildHeadSprintf, not_found, 404, "Not Found");
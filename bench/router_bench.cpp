@@ -0,0 +1,235 @@
+#include "github_routes.h"
+#include "router.h"
+#include <benchmark/benchmark.h>
+
+namespace
+{
+
+void noop(request_s *, response_s *, Context *) {}
+
+// 静态路由和参数路由, catchall 为 true 时再挂上几个 catch-all 前缀
+void setupRoutes(Engine &engine, bool catchall)
+{
+    const char *routes[] = {
+        "/",
+        "/about",
+        "/contact",
+        "/users",
+        "/users/:id",
+        "/users/:id/posts",
+        "/users/:id/posts/:post",
+        "/api/v1/status",
+        "/api/v1/items",
+        "/api/v1/items/:item",
+        "/static/index.html",
+        "/static/app.css",
+    };
+    for (auto *path : routes)
+    {
+        engine.handle("GET", path, noop);
+    }
+
+    if (catchall)
+    {
+        engine.handle("GET", "/assets/*filepath", noop);
+        engine.handle("GET", "/proxy/*upstream", noop);
+        engine.handle("GET", "/api/v2/*rest", noop);
+    }
+}
+
+void matchRoute(benchmark::State &state, bool catchall, const char *url)
+{
+    Engine engine;
+    setupRoutes(engine, catchall);
+
+    engine.freeze();
+    request_s req;
+    req.method = "GET";
+    req.url = url;
+    Route route;
+    for (auto _ : state)
+    {
+        route.reset();
+        engine.match(req, route);
+        benchmark::DoNotOptimize(route.handlers);
+    }
+}
+
+// 约 2k 条路由, 查找时树的节点分散在堆上的情况
+void matchLargeTable(benchmark::State &state)
+{
+    Engine engine;
+    for (int i = 0; i < 200; i++)
+    {
+        auto service = "/service" + std::to_string(i);
+        for (auto *suffix : {"", "/status", "/items", "/items/:item",
+                             "/items/:item/history", "/config", "/metrics",
+                             "/users/:user", "/users/:user/roles", "/files/*path"})
+        {
+            engine.handle("GET", service + suffix, noop);
+        }
+    }
+
+    // 按注册顺序轮流查找, 不让同一条路径一直留在缓存中
+    std::vector<std::string> urls;
+    for (int i = 0; i < 200; i += 7)
+    {
+        urls.push_back("/service" + std::to_string(i) + "/items/42/history");
+        urls.push_back("/service" + std::to_string(i) + "/metrics");
+        urls.push_back("/service" + std::to_string(i) + "/files/a/b.txt");
+    }
+
+    engine.freeze();
+    request_s req;
+    req.method = "GET";
+    Route route;
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        req.url = urls[i++ % urls.size()];
+        route.reset();
+        engine.match(req, route);
+        benchmark::DoNotOptimize(route.handlers);
+    }
+}
+
+void setupGithub(Engine &engine)
+{
+    for (const auto &route : GithubRoutes)
+    {
+        engine.handle(route.method, route.path, noop);
+    }
+}
+
+// GitHub API 路由表中的单条路径
+void matchGithub(benchmark::State &state, const char *method, const char *url)
+{
+    Engine engine;
+    setupGithub(engine);
+
+    engine.freeze();
+    request_s req;
+    req.method = method;
+    req.url = url;
+    Route route;
+    for (auto _ : state)
+    {
+        route.reset();
+        engine.match(req, route);
+        benchmark::DoNotOptimize(route.handlers);
+    }
+}
+
+// 依次查找 GitHub API 的全部路由, 参数用路由中的名字代替
+void matchGithubAll(benchmark::State &state)
+{
+    Engine engine;
+    setupGithub(engine);
+
+    std::vector<std::string> urls;
+    for (const auto &route : GithubRoutes)
+    {
+        std::string url;
+        for (const char *p = route.path; *p != '\0'; p++)
+        {
+            if (*p != ':')
+            {
+                url.push_back(*p);
+            }
+        }
+        urls.push_back(std::move(url));
+    }
+
+    engine.freeze();
+    request_s req;
+    Route route;
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < urls.size(); i++)
+        {
+            req.method = GithubRoutes[i].method;
+            req.url = urls[i];
+            route.reset();
+            engine.match(req, route);
+            benchmark::DoNotOptimize(route.handlers);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * urls.size());
+}
+
+// 参数数量达到上限 MaxParams 的路由
+void matchParams(benchmark::State &state)
+{
+    Engine engine;
+    std::string path;
+    std::string url;
+    for (size_t i = 0; i < MaxParams; i++)
+    {
+        path.append("/:").push_back(char('a' + i));
+        url.append("/").push_back(char('a' + i));
+    }
+    engine.handle("GET", path, noop);
+
+    engine.freeze();
+    request_s req;
+    req.method = "GET";
+    req.url = url;
+    Route route;
+    for (auto _ : state)
+    {
+        route.reset();
+        engine.match(req, route);
+        benchmark::DoNotOptimize(route.params.size());
+    }
+}
+
+// 20 层的静态路径, 每层都有一个兄弟节点
+void matchDeep(benchmark::State &state)
+{
+    Engine engine;
+    std::string path;
+    for (char c = 'a'; c < 'a' + 20; c++)
+    {
+        engine.handle("GET", path + "/x" + c, noop);
+        path.append("/").push_back(c);
+    }
+    engine.handle("GET", path, noop);
+
+    engine.freeze();
+    request_s req;
+    req.method = "GET";
+    req.url = path;
+    Route route;
+    for (auto _ : state)
+    {
+        route.reset();
+        engine.match(req, route);
+        benchmark::DoNotOptimize(route.handlers);
+    }
+}
+
+void cleanPathBench(benchmark::State &state, const char *path)
+{
+    std::string p = path;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(cleanPath(p));
+    }
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(matchRoute, static, false, "/api/v1/status");
+BENCHMARK_CAPTURE(matchRoute, static_with_catchall, true, "/api/v1/status");
+BENCHMARK_CAPTURE(matchRoute, param, false, "/users/42/posts/7");
+BENCHMARK_CAPTURE(matchRoute, param_with_catchall, true, "/users/42/posts/7");
+BENCHMARK_CAPTURE(matchRoute, catchall, true, "/assets/js/vendor/app.min.js");
+BENCHMARK(matchLargeTable);
+BENCHMARK_CAPTURE(matchGithub, static, "GET", "/user/repos");
+BENCHMARK_CAPTURE(matchGithub, param, "GET", "/repos/julienschmidt/httprouter/stargazers");
+BENCHMARK_CAPTURE(matchGithub, params4, "GET", "/legacy/issues/search/gin/libgin/open/router");
+BENCHMARK(matchGithubAll);
+BENCHMARK(matchParams);
+BENCHMARK(matchDeep);
+BENCHMARK_CAPTURE(cleanPathBench, clean, "/repos/mviruch/libgin/issues/42");
+BENCHMARK_CAPTURE(cleanPathBench, dirty, "//repos/./mviruch/../mviruch/libgin//issues/42/");
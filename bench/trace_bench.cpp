@@ -0,0 +1,50 @@
+#include "router.h"
+#include "tracing.h"
+#include <benchmark/benchmark.h>
+
+namespace
+{
+
+// 4 个中间件加 handler 的处理链, every 为 0 时不启用追踪
+void serveChain(benchmark::State &state, unsigned int every)
+{
+    Engine engine;
+    for (int i = 0; i < 4; i++)
+    {
+        engine.use([](Context *ctx) { ctx->next(); });
+    }
+    engine.handle("GET", "/users/:id",
+                  [](request_s *, response_s *res, Context *)
+                  { benchmark::DoNotOptimize(res); });
+
+    Tracer *tracer = nullptr;
+    if (every > 0)
+    {
+        trace_open(&tracer, every, 4096);
+        engine.setTracer(tracer);
+    }
+
+    engine.freeze();
+    request_s req;
+    req.method = "GET";
+    req.url = "/users/42";
+    response_s res;
+    Route route;
+    engine.match(req, route);
+    for (auto _ : state)
+    {
+        engine.ServeHTTP(req, res, route);
+    }
+
+    engine.setTracer(nullptr);
+    if (tracer != nullptr)
+    {
+        trace_close(tracer);
+    }
+}
+
+} // namespace
+
+BENCHMARK_CAPTURE(serveChain, off, 0);
+BENCHMARK_CAPTURE(serveChain, sample_1_in_100, 100);
+BENCHMARK_CAPTURE(serveChain, sample_all, 1);
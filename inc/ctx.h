@@ -1,176 +1,520 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <cstring>
 #include <sstream>
 #include <string>
-#include <unordered_map>
-
-struct CaseInsensitiveHash {
-    size_t operator()(const std::string &key) const {
-        std::string lowerKey = key;
-        std::transform(lowerKey.begin(), lowerKey.end(), lowerKey.begin(), ::tolower);
-        return std::hash<std::string>()(lowerKey); // 使用标准库的哈希函数
-    }
-};
+#include <string_view>
+#include <vector>
 
 struct CaseInsensitiveEqual {
-    bool operator()(const std::string &a, const std::string &b) const {
+    bool operator()(std::string_view a, std::string_view b) const {
         return std::equal(a.begin(), a.end(), b.begin(), b.end(),
                           [](char c1, char c2) { return ::tolower(c1) == ::tolower(c2); });
     }
 };
 
+struct header_s
+{
+    std::string_view key;
+    std::string_view value;
+};
+
+// 请求头表, 按到达顺序保存, 查找时忽略大小写.
+// 前 16 个存放在内置数组中, 一般的请求不会分配内存
+struct headers_s
+{
+private:
+    static constexpr size_t inline_capacity = 16;
+    header_s fixed[inline_capacity];
+    std::vector<header_s> overflow;
+    size_t count = 0;
+
+public:
+    auto size() const -> size_t { return count; }
+
+    auto operator[](size_t i) const -> const header_s &
+    {
+        return i < inline_capacity ? fixed[i] : overflow[i - inline_capacity];
+    }
+
+    void add(std::string_view key, std::string_view value)
+    {
+        if (count < inline_capacity)
+        {
+            fixed[count] = {key, value};
+        }
+        else
+        {
+            overflow.push_back({key, value});
+        }
+        count++;
+    }
+
+    // 返回第一个同名的请求头, 不存在时返回 nullptr
+    auto find(std::string_view key) const -> const header_s *
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const header_s &header = (*this)[i];
+            if (CaseInsensitiveEqual()(header.key, key))
+            {
+                return &header;
+            }
+        }
+        return nullptr;
+    }
+
+    // 获取请求头的值, 不存在时返回空
+    auto get(std::string_view key) const -> std::string_view
+    {
+        const header_s *header = find(key);
+        return header != nullptr ? header->value : std::string_view();
+    }
+
+    void clear()
+    {
+        count = 0;
+        overflow.clear();
+    }
+};
+
+// 响应头表, 按添加顺序写出, 查找时忽略大小写.
+// clear 只把数量归零, 各字段的字符串留着容量给下一个响应, 复用时不再分配内存
+struct response_headers_s
+{
+private:
+    struct field_s
+    {
+        std::string key;
+        std::string value;
+    };
+    std::vector<field_s> fields;
+    size_t count = 0;
+
+    auto index(std::string_view key) const -> size_t
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (CaseInsensitiveEqual()(fields[i].key, key))
+            {
+                return i;
+            }
+        }
+        return count;
+    }
+
+public:
+    auto begin() const { return fields.begin(); }
+    auto end() const { return fields.begin() + count; }
+    auto size() const -> size_t { return count; }
+
+    // 不存在时返回 nullptr
+    auto find(std::string_view key) const -> const std::string *
+    {
+        size_t i = index(key);
+        return i < count ? &fields[i].value : nullptr;
+    }
+
+    // 设置字段的值, 已有同名字段时替换
+    void set(std::string_view key, std::string_view value)
+    {
+        size_t i = index(key);
+        if (i == count)
+        {
+            if (count == fields.size())
+            {
+                fields.emplace_back();
+            }
+            fields[count++].key.assign(key);
+        }
+        fields[i].value.assign(value);
+    }
+
+    void erase(std::string_view key)
+    {
+        size_t i = index(key);
+        if (i < count)
+        {
+            // 移到末尾, 保持其余字段的顺序和被删字段的容量
+            std::rotate(fields.begin() + i, fields.begin() + i + 1,
+                        fields.begin() + count);
+            count--;
+        }
+    }
+
+    void clear() { count = 0; }
+};
+
+// 登记的状态码和默认的状态消息
+#define GIN_STATUS_MAP(XX)                         \
+    XX(100, "Continue")                            \
+    XX(101, "Switching Protocols")                 \
+    XX(200, "OK")                                  \
+    XX(201, "Created")                             \
+    XX(202, "Accepted")                            \
+    XX(204, "No Content")                          \
+    XX(206, "Partial Content")                     \
+    XX(301, "Moved Permanently")                   \
+    XX(302, "Found")                               \
+    XX(303, "See Other")                           \
+    XX(304, "Not Modified")                        \
+    XX(307, "Temporary Redirect")                  \
+    XX(308, "Permanent Redirect")                  \
+    XX(400, "Bad Request")                         \
+    XX(401, "Unauthorized")                        \
+    XX(403, "Forbidden")                           \
+    XX(404, "Not Found")                           \
+    XX(405, "Method Not Allowed")                  \
+    XX(406, "Not Acceptable")                      \
+    XX(408, "Request Timeout")                     \
+    XX(409, "Conflict")                            \
+    XX(410, "Gone")                                \
+    XX(411, "Length Required")                     \
+    XX(412, "Precondition Failed")                 \
+    XX(413, "Payload Too Large")                   \
+    XX(414, "URI Too Long")                        \
+    XX(415, "Unsupported Media Type")              \
+    XX(416, "Range Not Satisfiable")               \
+    XX(417, "Expectation Failed")                  \
+    XX(418, "I'm a teapot")                        \
+    XX(422, "Unprocessable Entity")                \
+    XX(426, "Upgrade Required")                    \
+    XX(429, "Too Many Requests")                   \
+    XX(431, "Request Header Fields Too Large")     \
+    XX(500, "Internal Server Error")               \
+    XX(501, "Not Implemented")                     \
+    XX(502, "Bad Gateway")                         \
+    XX(503, "Service Unavailable")                 \
+    XX(504, "Gateway Timeout")                     \
+    XX(505, "HTTP Version Not Supported")
+
+// 状态码都小于 MaxStatusCode
+constexpr int MaxStatusCode = 600;
+
+// 编译期生成的状态消息和完整状态行 "HTTP/1.1 200 OK\r\n", 未登记的状态码为空
+struct StatusTable
+{
+    std::array<std::string_view, MaxStatusCode> reasons{};
+    std::array<std::string_view, MaxStatusCode> lines{};
+
+    constexpr StatusTable()
+    {
+#define XX(code, reason)                               \
+    reasons[code] = reason;                            \
+    lines[code] = "HTTP/1.1 " #code " " reason "\r\n";
+        GIN_STATUS_MAP(XX)
+#undef XX
+    }
+};
+
+inline constexpr StatusTable Statuses{};
+
+// 流式响应的输出端, 由服务器为每个请求提供
+struct response_stream_s
+{
+    virtual ~response_stream_s() = default;
+    virtual auto write(const char *data, size_t size) -> bool = 0;
+    virtual auto flush() -> bool = 0;
+    virtual void end() = 0;
+    // handler 出错, 不写结束块, 以关闭连接结束响应
+    virtual void fail() = 0;
+    virtual auto isStarted() -> bool = 0;
+};
 
 struct response_s
 {
 private:
     std::string http_version = "HTTP/1.1";                // 默认 HTTP 版本
     int status_code = 200;                                // 默认状态码
-    std::string status_message = "OK";                    // 默认状态消息
-    std::unordered_map<std::string, std::string> headers; // 响应头
+    std::string status_message;                           // 自定义的状态消息, 为空时使用默认的
+    response_headers_s headers;                           // 响应头
     std::string body;                                     // 响应正文
+    response_stream_s *stream = nullptr;                  // 流式响应的输出端
+
+    // 外部持有的响应正文, 写出后调用 release(release_arg) 归还
+    const char *external = nullptr;
+    size_t external_size = 0;
+    void (*release)(void *arg) = nullptr;
+    void *release_arg = nullptr;
+
+    void releaseExternal()
+    {
+        if (release != nullptr)
+        {
+            release(release_arg);
+        }
+        external = nullptr;
+        external_size = 0;
+        release = nullptr;
+        release_arg = nullptr;
+    }
 
     // 获取默认状态消息
-    auto getDefaultStatusMessage(int code) -> std::string
-    {
-        switch (code)
-        {
-        case 100:
-            return "Continue";
-        case 201:
-            return "Created";
-        case 202:
-            return "Accepted";
-        case 204:
-            return "No Content";
-        case 206:
-            return "Partial Content";
-        case 301:
-            return "Moved Permanently";
-        case 302:
-            return "Found";
-        case 304:
-            return "Not Modified";
-        case 400:
-            return "Bad Request";
-        case 401:
-            return "Unauthorized";
-        case 403:
-            return "Forbidden";
-        case 404:
-            return "Not Found";
-        case 416:
-            return "Range Not Satisfiable";
-        case 418:
-            return "I'm a teapot";
-        case 500:
-            return "Internal Server Error";
-        case 501:
-            return "Not Implemented";
-        default:
-            return "Unknown";
+    static auto getDefaultStatusMessage(int code) -> std::string_view
+    {
+        if (code >= 0 && code < MaxStatusCode && !Statuses.reasons[code].empty())
+        {
+            return Statuses.reasons[code];
         }
+        return "Unknown";
+    }
+
+    void setContentLength(size_t size)
+    {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), size);
+        headers.set("Content-Length", std::string_view(buf, res.ptr - buf));
     }
 
 public:
     // 设置 HTTP 版本
-    auto setVersion(const std::string &version) -> response_s *
+    auto setVersion(std::string_view version) -> response_s *
     {
         http_version = version;
         return this;
     }
 
-    // 设置状态码和状态消息
-    auto setStatus(int code, const std::string &message = "") -> response_s *
+    // 设置状态码和状态消息, 没有 message 时使用默认的状态消息
+    auto setStatus(int code, std::string_view message = {}) -> response_s *
     {
         status_code = code;
-        status_message =
-            message.empty() ? getDefaultStatusMessage(code) : message;
+        status_message = message;
         return this;
     }
 
-    // 添加响应头
-    auto addHeader(const std::string &key,
-                   const std::string &value) -> response_s *
+    auto getStatus() -> int { return status_code; }
+
+    // 获取响应头
+    auto getHeader(std::string_view key, std::string &value) const -> bool
+    {
+        const std::string *found = headers.find(key);
+        if (found == nullptr)
+        {
+            return false;
+        }
+        value = *found;
+        return true;
+    }
+
+    // 添加响应头, 已有同名的响应头时替换
+    auto addHeader(std::string_view key, std::string_view value) -> response_s *
     {
-        headers[key] = value;
+        headers.set(key, value);
         return this;
     }
 
-    // 设置响应正文
-    auto setBody(const std::string &response_body) -> response_s *
+    // 删除响应头
+    auto removeHeader(std::string_view key) -> response_s *
     {
-        body = response_body;
-        addHeader("Content-Length",
-                  std::to_string(body.size())); // 自动设置 Content-Length
+        headers.erase(key);
         return this;
     }
 
-    // 构建完整的响应字符串
-    auto build(char *&buf) const -> int
+    // 流式写出响应正文, 第一次写入时发出状态行和响应头, 之后不能再修改它们.
+    // 使用 chunked 编码 (HTTP/1.0 以关闭连接结束), 未写出的数据过多时阻塞,
+    // 连接已关闭时返回 false. handler 返回时自动 end.
+    // Execution::Inline 的路由不能阻塞事件循环, 数据追加到 body 中一次写出
+    auto write(std::string_view data) -> bool
     {
-        // 1. 计算所需的总缓冲区大小
-        size_t total_size = 0;
+        if (stream != nullptr)
+        {
+            return stream->write(data.data(), data.size());
+        }
+        if (external != nullptr)
+        {
+            body.assign(external, external_size);
+            releaseExternal();
+        }
+        body.append(data);
+        setContentLength(body.size());
+        return true;
+    }
 
-        // 起始行长度: "HTTP/1.1 200 OK\r\n"
-        total_size += http_version.size() + 1 +
-                      std::to_string(status_code).size() + 1 +
-                      status_message.size() + 2;
+    // 立即把已写入的数据交给事件循环写出, 否则积攒到一定大小再写出
+    auto flush() -> bool { return stream != nullptr ? stream->flush() : true; }
 
-        // 每个头部的长度: "Key: Value\r\n"
-        for (const auto &[key, value] : headers)
+    // 结束流式响应
+    void end()
+    {
+        if (stream != nullptr)
         {
-            total_size += key.size() + 2 + value.size() + 2;
+            stream->end();
         }
+    }
 
-        // 空行（分隔头部和正文）
-        total_size += 2;
+    // 流式响应已开始写出, 不能再修改状态行和响应头
+    auto isStreaming() const -> bool
+    {
+        return stream != nullptr && stream->isStarted();
+    }
 
-        // 正文的长度
-        total_size += body.size();
+    // 流式响应出错, 对端会看到连接在响应结束前关闭
+    void fail()
+    {
+        if (stream != nullptr)
+        {
+            stream->fail();
+        }
+    }
 
-        // 2. 分配内存：+1 用于字符串结束符 '\0'
-        buf = new char[total_size + 1];
-        char *write_ptr = buf;
+    // 由服务器在执行 handler 之前设置
+    void setStream(response_stream_s *output) { stream = output; }
 
-        // 3. 构建 HTTP 响应字符串
+    // 当前的输出端, 中间件可以换成自己的包装再在返回前换回
+    auto getStream() const -> response_stream_s * { return stream; }
 
-        // 写入起始行
-        write_ptr +=
-            std::sprintf(write_ptr, "%s %d %s\r\n", http_version.c_str(),
-                         status_code, status_message.c_str());
+    response_s() = default;
+    response_s(const response_s &) = delete;
+    auto operator=(const response_s &) -> response_s & = delete;
+    ~response_s() { releaseExternal(); }
 
-        // 写入头部
-        for (const auto &[key, value] : headers)
+    // 设置响应正文, 拷贝到复用的 body 中
+    auto setBody(std::string_view response_body) -> response_s *
+    {
+        releaseExternal();
+        body.assign(response_body);
+        setContentLength(body.size()); // 自动设置 Content-Length
+        return this;
+    }
+
+    auto setBody(const char *response_body) -> response_s *
+    {
+        return setBody(std::string_view(response_body));
+    }
+
+    // 设置响应正文, 接管 response_body 的内存, 写出时不再拷贝
+    auto setBody(std::string &&response_body) -> response_s *
+    {
+        releaseExternal();
+        body = std::move(response_body);
+        setContentLength(body.size());
+        return this;
+    }
+
+    // 使用外部持有的数据作为响应正文, 直接写出不拷贝. 数据在写出完成
+    // (或请求被丢弃) 之前须保持有效, 之后在事件循环线程上调用 cb(arg)
+    auto setBody(const char *data, size_t size, void (*cb)(void *arg),
+                 void *arg) -> response_s *
+    {
+        releaseExternal();
+        body.clear();
+        external = data;
+        external_size = size;
+        release = cb;
+        release_arg = arg;
+        setContentLength(size);
+        return this;
+    }
+
+    // 响应正文, 外部数据或 body
+    auto getBody() const -> std::string_view
+    {
+        if (external != nullptr)
         {
-            write_ptr += std::sprintf(write_ptr, "%s: %s\r\n", key.c_str(),
-                                      value.c_str());
+            return {external, external_size};
         }
+        return body;
+    }
+
+    // 重置为默认状态, 以便在同一连接上复用
+    void reset()
+    {
+        http_version = "HTTP/1.1";
+        status_code = 200;
+        status_message.clear();
+        headers.clear();
+        body.clear();
+        stream = nullptr;
+        releaseExternal();
+    }
 
-        // 写入空行
-        write_ptr += std::sprintf(write_ptr, "\r\n");
+    // 把状态行和响应头追加到 out, 正文由调用方单独写出.
+    // date 和 server 是事件循环预先生成的完整头部行, handler 自己设置了时不使用
+    void buildHead(std::string &out, std::string_view date = {},
+                   std::string_view server = {}) const
+    {
+        // 默认的状态行直接取预先生成的
+        if (status_message.empty() && status_code >= 0 &&
+            status_code < MaxStatusCode &&
+            !Statuses.lines[status_code].empty() && http_version == "HTTP/1.1")
+        {
+            out.append(Statuses.lines[status_code]);
+        }
+        else
+        {
+            char code[16];
+            auto res = std::to_chars(code, code + sizeof(code), status_code);
+            out.append(http_version).append(1, ' ').append(code, res.ptr);
+            out.append(1, ' ');
+            out.append(status_message.empty()
+                           ? getDefaultStatusMessage(status_code)
+                           : std::string_view(status_message));
+            out.append("\r\n", 2);
+        }
 
-        // 写入正文
-        if (!body.empty())
+        if (!date.empty() && headers.find("Date") == nullptr)
+        {
+            out.append(date);
+        }
+        if (!server.empty() && headers.find("Server") == nullptr)
         {
-            memcpy(write_ptr, body.c_str(), body.size());
-            write_ptr += body.size();
+            out.append(server);
         }
 
-        // 添加终止符 '\0'
-        *write_ptr = '\0';
+        // 每个头部 "Key: Value\r\n", 最后是空行
+        size_t size = 2;
+        for (const auto &[key, value] : headers)
+        {
+            size += key.size() + 2 + value.size() + 2;
+        }
 
-        // 4. 返回实际字符串长度
-        return static_cast<int>(total_size);
+        size_t start = out.size();
+        out.resize(start + size);
+        char *p = &out[start];
+        for (const auto &[key, value] : headers)
+        {
+            std::memcpy(p, key.data(), key.size());
+            p += key.size();
+            *p++ = ':';
+            *p++ = ' ';
+            std::memcpy(p, value.data(), value.size());
+            p += value.size();
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+        *p++ = '\r';
+        *p = '\n';
     }
 };
 
+// 请求行和请求头都指向连接为该请求保留的缓冲区, 在请求处理完之前有效
 struct request_s
 {
-    std::string method;
-    std::string url;
-    std::string version;
-    std::unordered_map<std::string, std::string, CaseInsensitiveHash, CaseInsensitiveEqual> headers;
+    std::string_view method;
+    // llhttp_method_t 编号, -1 表示未知, 这时按 method 查找
+    int method_id = -1;
+    std::string_view url;
+    std::string_view version;
+    headers_s headers;
     std::istream *body;
+    // 完整的请求体, 只有 BodyMode::Buffered 和 Execution::Inline 的路由可用,
+    // 此时 body 流读取的也是这里的数据
+    std::string_view data;
+    // chunked 请求体之后的 trailer, 读到请求体的 EOF 之后才可用
+    headers_s trailers;
+
+    // 清空上一次请求的内容, body 流由连接持有
+    void reset()
+    {
+        method = {};
+        method_id = -1;
+        url = {};
+        version = {};
+        headers.clear();
+        data = {};
+        trailers.clear();
+    }
 };
@@ -2,11 +2,23 @@
 
 #include "llhttp.h"
 #include "router.h"
+#include <sstream>
 #include <streambuf>
+#include <string>
 #include <uv.h>
+#include <vector>
 
+class BodyStreambuf;
+class Executor;
+struct ReadBuffer;
+class ReadBufferPool;
+class Metrics;
+class SpanStreambuf;
+class ResponseWriter;
+struct uv_http_s;
 struct uv_http_conn_s;
 using request_t = struct request_s;
+using uv_http_message_t = struct uv_http_message_s;
 
 using uv_http_event_t = enum uv_http_event {
     UV_HTTP_ERROR,   /**< (const char*) Error. */
@@ -61,6 +73,16 @@ struct waitgroup_s
     }
 };
 
+// 提交到 worker 线程池的任务, work 在 worker 线程上执行,
+// done 回到 http 所在的事件循环线程上执行
+struct uv_http_task_s
+{
+    void (*work)(uv_http_task_s *task);
+    void (*done)(uv_http_task_s *task);
+    uv_http_s *http;
+    uv_http_task_s *next;
+};
+
 struct uv_http_s
 {
     uv_loop_s *loop;
@@ -69,31 +91,228 @@ struct uv_http_s
     Engine *engine;
     // uv_http_data_t data;
     waitgroup_s wg;
+
+    // keep-alive 空闲超时 (毫秒), 0 表示关闭 keep-alive
+    uint64_t keepalive_timeout;
+    // 单个连接上最多处理的请求数, 0 表示不限制
+    unsigned int max_requests;
+    // 单个连接上同时处理的流水线请求数
+    unsigned int max_pipeline;
+    // 请求行加请求头的最大字节数, 超过时关闭连接
+    size_t max_header_size;
+    // handler 线程上积压的请求体引用的读缓冲区超过 body_high_water 字节时
+    // 暂停读取, 降到 body_low_water 后恢复
+    size_t body_high_water;
+    size_t body_low_water;
+    // BodyMode::Buffered 和 Execution::Inline 路由的请求体上限, 超过时响应 413
+    size_t max_body_size;
+    // 流式响应未写出的数据超过这个值时 handler 线程等待
+    size_t write_high_water;
+    // 读缓冲区的大小和池中最多保留的空闲缓冲区数
+    size_t read_buffer_size;
+    unsigned int read_buffer_count;
+    ReadBufferPool *readpool;
+
+    // 预先生成的 "Date: ...\r\n", 由 date_timer 每秒刷新
+    uv_timer_s date_timer;
+    std::string date_header;
+    // 预先生成的 "Server: ...\r\n", 为空时不发送
+    std::string server_header;
+
+    // 由 uv_http_metrics 开启, listen 时创建 metrics, 各事件循环共享
+    bool metrics_enabled;
+    Metrics *metrics;
+
+    // uv_http_listen_multi 启动的其它事件循环, 每个运行在自己的线程上
+    std::vector<uv_http_s *> shards;
+    uv_http_s *parent;
+    uv_thread_t thread;
+    uv_async_s stop;
+
+    // 当前所有连接, uv_http_stop 时用来关闭空闲连接
+    uv_http_conn_s *conns;
+    // 已关闭的连接, 连同各自的空闲请求留给新连接复用
+    uv_http_conn_s *freeconns;
+    unsigned int nfreeconns;
+    bool stopping;
+
+    // Execution::ThreadPool 路由使用的 handler 线程池, 各事件循环共享
+    Executor *executor;
+    // Execution::Worker 路由使用的线程池, 由 uv_http_workers 创建
+    Executor *workers;
+    // 线程池上已完成的任务, 由 completed 批量唤醒事件循环处理
+    uv_async_s completed;
+    uv_mutex_t completed_mutex;
+    uv_http_task_s *completed_head;
+    // 已提交但还没回到事件循环的任务数
+    unsigned int tasks;
+};
+
+// 连接上的一个请求/响应, 按到达顺序排队
+struct uv_http_message_s
+{
+    uv_http_task_s task;
+    uv_http_conn_s *conn;
+    uv_http_message_s *next = nullptr;
+
+    // 在事件循环线程上匹配到的路由
+    Route route;
+
+    // 请求行和请求头的原始数据, 容量固定为 max_header_size,
+    // request 中的 string_view 都指向这里
+    std::string head;
+
+    // 交给 handler 线程的请求体, 引用读缓冲区中的数据
+    BodyStreambuf *buf;
+    // 请求体读完整后才执行 handler (BodyMode::Buffered 或 Execution::Inline),
+    // 有 Content-Length 时预留好容量
+    bool buffered = false;
+    std::string data;
+    SpanStreambuf *databuf;
+
+    request_t request;
+    response_s response;
+
+    // 流式响应, handler 写入数据后通过 flushtask 通知事件循环写出
+    ResponseWriter *writer;
+    uv_http_task_s flushtask;
+    // 正在写出的流式响应数据
+    std::string sending;
+    size_t inflight = 0;
+    // 状态行和响应头已写出
+    bool headsent = false;
+    // 整个响应都已交给 uv_write
+    bool finished = false;
+
+    // 开启统计时各阶段的开始时间 (uv_hrtime): 收到请求的第一个字节,
+    // 提交到线程池, 响应头交给 uv_write
+    uint64_t received = 0;
+    uint64_t submitted = 0;
+    uint64_t sent = 0;
+
+    bool keepalive = false;
+    // 请求已解析完成
+    bool complete = false;
+    // handler 已执行完, 响应可以写出
+    bool done = false;
 };
 
 struct uv_http_conn_s
 {
     uv_tcp_s client;
     uv_http_s *http;
-    uv_work_s work;
+    uv_http_conn_s *prev = nullptr;
+    uv_http_conn_s *next = nullptr;
 
     // http 解析器
     llhttp_t parser;
     llhttp_settings_t settings;
 
-    std::streambuf *buf;
+    // 正在解析的字段在 head 中的起始位置, 字段可能跨多次读取分段回调
+    size_t mark = 0;
+    std::string_view currentheaderfield;
+    // 请求头已结束, 之后解析到的字段是 chunked 请求体的 trailer
+    bool trailing = false;
 
-    std::string currentheaderfield;
+    // 进行中的请求队列, head 最先到达
+    uv_http_message_s *head = nullptr;
+    uv_http_message_s *tail = nullptr;
+    // 正在解析的请求
+    uv_http_message_s *parsing = nullptr;
+    // 可复用的请求
+    uv_http_message_s *spare = nullptr;
+    unsigned int queued = 0;
 
-    request_t request;
-    response_s response;
-    char *response_str;
+    // 正在写出的响应数 (包括写出了一部分的流式响应), 写完之前新完成的响应先排队
+    uv_write_s write;
+    unsigned int writing = 0;
+    // 正在写出的各响应的状态行和响应头, 正文不拷贝, 和它们一起组成 bufs
+    std::string headbuf;
+    std::vector<uv_buf_t> bufs;
+
+    // keep-alive 空闲计时器
+    uv_timer_s timer;
+    // 已处理的请求数
+    unsigned int requests = 0;
+    // 未关闭的句柄数与未完成的 work 数, 归零时释放连接
+    int refs = 0;
+    // 正在解析的读缓冲区, 请求体的数据块引用它
+    ReadBuffer *reading = nullptr;
+    // 暂停解析后读到的后续数据, 队列有空位后再解析
+    ReadBuffer *pending = nullptr;
+    const char *pendingdata = nullptr;
+    size_t pendinglen = 0;
+    // 跨多次读取的请求体中的小块拷贝到这里, 不占住整个读缓冲区,
+    // retainedlen 之后的部分还没有使用
+    ReadBuffer *retained = nullptr;
+    size_t retainedlen = 0;
 
+    bool paused = false;
+    // handler 读取请求体跟不上时暂停读取, 积压消化后由 resume 回到事件循环恢复
+    bool throttled = false;
+    uv_http_task_s resume{};
+    // 对端已半关闭
+    bool eof = false;
     bool closed = false;
 };
 
+// 读缓冲区池的统计, 多个事件循环时为各事件循环之和
+struct uv_http_read_stats_s
+{
+    // 从池中取到空闲缓冲区的次数
+    uint64_t hits;
+    // 池中没有空闲缓冲区而新分配的次数
+    uint64_t misses;
+    // 池中当前空闲的缓冲区数
+    size_t cached;
+};
+
+// 失败时已创建的句柄正在关闭, 运行 loop 让关闭完成后才能释放 http
 auto uv_http_init(uv_http_s *http, uv_loop_s *loop, Engine *engine) -> int;
 auto uv_http_listen(uv_http_s *http, const char *ip, int port) -> int;
+auto uv_http_keepalive(uv_http_s *http, uint64_t timeout,
+                       unsigned int max_requests) -> int;
+auto uv_http_pipeline(uv_http_s *http, unsigned int depth) -> int;
+auto uv_http_header_limit(uv_http_s *http, size_t size) -> int;
+// 设置请求体的积压上限, 积压的数据块引用的读缓冲区超过 high 字节时暂停读取连接,
+// 降到 low 字节后恢复
+auto uv_http_body_buffer(uv_http_s *http, size_t high, size_t low) -> int;
+// 设置完整读取的请求体的上限, 超过时不执行 handler, 响应 413 后关闭连接
+auto uv_http_body_limit(uv_http_s *http, size_t size) -> int;
+// 设置流式响应的写出缓冲上限, 未写出的数据超过 size 字节时 handler 的 write 阻塞
+auto uv_http_response_buffer(uv_http_s *http, size_t size) -> int;
+// 设置读缓冲区的大小和每个事件循环最多保留的空闲缓冲区数, 需在 listen 之前调用
+auto uv_http_read_buffer(uv_http_s *http, size_t size, unsigned int count) -> int;
+auto uv_http_read_stats(uv_http_s *http, uv_http_read_stats_s *stats) -> int;
+// 设置每个响应都带上的 Server 头部, name 为空时不发送
+auto uv_http_server_name(uv_http_s *http, const char *name) -> int;
+// 开启统计, 需在 listen 之前调用. 按路由记录解析, 排队, handler, 序列化和写出
+// 各阶段的耗时分布, 以及连接数, 收发字节数和各类状态码的响应数
+auto uv_http_metrics(uv_http_s *http) -> int;
+// 以 Prometheus 文本格式追加到 out, 没有开启统计或还没有 listen 时返回 UV_EINVAL
+auto uv_http_metrics_render(uv_http_s *http, std::string &out) -> int;
+// 开启统计, 并注册输出统计数据的 GET 路由, 需在 listen 之前调用,
+// 路由表已编译 (已经 listen) 时返回 UV_EBUSY
+auto uv_http_metrics_route(uv_http_s *http, const std::string &path) -> int;
+// 创建 Execution::ThreadPool 路由使用的 handler 线程池, 需在 listen 之前调用,
+// 未创建时 listen 按 CPU 核数 (至少 4 个) 创建. nthreads 为 0 时按 CPU 核数,
+// cpus 不为空时第 i 个线程绑定到 cpus[i % ncpus]
+auto uv_http_threads(uv_http_s *http, unsigned int nthreads,
+                     const int *cpus = nullptr, unsigned int ncpus = 0) -> int;
+// 创建 Execution::Worker 路由使用的线程池, 参数同 uv_http_threads,
+// 未创建时这些路由在 handler 线程池上执行
+auto uv_http_workers(uv_http_s *http, unsigned int nthreads,
+                     const int *cpus = nullptr, unsigned int ncpus = 0) -> int;
+// 在 nloops 个事件循环上监听同一端口, http 所在的 loop 是第一个,
+// 其余各自在新线程上运行, nloops <= 0 时按 CPU 核数.
+// 返回错误时没有事件循环在监听端口: 第一个事件循环开始监听后出错时,
+// 已启动的其它事件循环停止, 第一个也像 uv_http_stop 一样关闭,
+// 之后需运行 http 所在的 loop 让句柄关闭完成
+auto uv_http_listen_multi(uv_http_s *http, const char *ip, int port,
+                          int nloops) -> int;
+// 停止接受新连接并关闭空闲连接, 等待其它事件循环处理完后退出.
+// 需在 http 所在事件循环的线程上调用, 例如在它的回调中
+auto uv_http_stop(uv_http_s *http) -> int;
 
 auto uv_http_conn_init(uv_http_conn_s *conn, uv_http_s *http) -> int;
 
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+
+struct Context;
+
+// 响应压缩中间件, 按请求的 Accept-Encoding 选择 gzip 或 deflate.
+// 正文不足 threshold 字节、已有 Content-Encoding、或 Content-Type
+// 是图片、音视频、压缩包等已压缩的格式时原样返回.
+// 流式响应先积攒 threshold 字节 (或到第一次 flush) 再决定, 之后边写边压缩.
+// 每个线程复用自己的 zlib 流, 请求之间只重置不重新初始化.
+// 放在 recover 之后注册, handler 抛出的异常先经过这里再由 recover 处理
+struct compression
+{
+    // zlib 的压缩级别, 1 最快, 9 压缩率最高
+    int level = 6;
+    size_t threshold = 1024;
+    void operator()(Context *ctx);
+};
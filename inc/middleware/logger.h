@@ -1,14 +1,59 @@
 #pragma once
 
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 struct Context;
+class AccessLog;
 
 typedef void (*logfunc)(std::chrono::_V2::system_clock::time_point now, std::string method, std::string uri, int status, std::chrono::microseconds duration);
+// 同 logfunc, 方法和 URI 不拷贝, 只在调用期间有效
+typedef void (*logviewfunc)(std::chrono::_V2::system_clock::time_point now, std::string_view method, std::string_view uri, int status, std::chrono::microseconds duration);
 
+// 一条访问日志, 定长, 方法和 URI 超出时截断
+struct access_record_s
+{
+    // 请求处理完的时间, Unix 纪元以来的微秒数
+    int64_t time;
+    // 处理耗时, 微秒
+    int64_t duration;
+    int32_t status;
+    uint16_t methodlen;
+    uint16_t urilen;
+    char method[16];
+    char uri[224];
+};
+
+// 在后台线程上批量接收访问日志
+typedef void (*logsink)(const access_record_s *records, size_t count, void *arg);
+
+// 异步访问日志: 请求线程把记录写入各自线程的环形缓冲区, 不加锁也不做系统调用,
+// 后台线程每 interval 毫秒批量取出. 环形缓冲区满时丢弃记录并计数.
+// capacity 是每个线程的环形缓冲区能容纳的记录数, 向上取到 2 的幂
+
+// 格式化后追加写入 path 指向的文件, 出错时返回 libuv 的错误码
+auto access_log_open(AccessLog **log, const char *path, size_t capacity = 4096,
+                     unsigned int interval = 100) -> int;
+// 交给 sink 处理
+auto access_log_sink(AccessLog **log, logsink sink, void *arg,
+                     size_t capacity = 4096, unsigned int interval = 100)
+    -> int;
+// 因环形缓冲区满而丢弃的记录数
+auto access_log_dropped(AccessLog *log) -> uint64_t;
+// 取出剩余的记录, 停止后台线程并释放, 之后不能再有请求写入
+void access_log_close(AccessLog *log);
+
+// 访问日志中间件. access 不为空时写入异步访问日志,
+// 否则在请求线程上同步调用 logview 或 log, log 的签名和之前相同,
+// 每次调用拷贝方法和 URI
 struct logger
 {
     logfunc log;
+    AccessLog *access = nullptr;
+    // 不为空时代替 log
+    logviewfunc logview = nullptr;
     void operator()(Context *ctx);
-};
\ No newline at end of file
+};
@@ -1,6 +1,10 @@
 #pragma once
 
+#include "ctx.h"
+
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstring>
 #include <functional>
 #include <string>
@@ -10,31 +14,140 @@
 #include <vector>
 
 class node;
+struct FrozenRoutes;
 class Engine;
 class Context;
+class Tracer;
 struct request_s;
 struct response_s;
 
-using Params = std::unordered_map<std::string, std::string>;
 using Handler = std::function<void(Context *)>;
 using RouteHandler = std::function<void(request_s *, response_s *, Context *)>;
 using HandlerChain = std::vector<Handler>;
 
+// 单个路由最多的参数个数
+constexpr size_t MaxParams = 16;
+
+// 路由参数, key 指向路由树中的参数名, value 指向请求的路径
+struct Param
+{
+    std::string_view key;
+    std::string_view value;
+};
+
+// 固定容量的路由参数表, 匹配时不分配内存
+struct Params
+{
+private:
+    std::array<Param, MaxParams> items;
+    size_t count = 0;
+
+public:
+    auto size() const -> size_t { return count; }
+    auto operator[](size_t i) const -> const Param & { return items[i]; }
+
+    void add(std::string_view key, std::string_view value)
+    {
+        if (count < MaxParams)
+        {
+            items[count++] = {key, value};
+        }
+    }
+
+    // 获取参数值, 不存在时返回 nullptr
+    auto find(std::string_view key) const -> const std::string_view *
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (items[i].key == key)
+            {
+                return &items[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    void clear() { count = 0; }
+};
+
+// 路由树按 llhttp 的方法编号 (llhttp_method_t) 存放, 编号都小于 MethodCount
+constexpr int MethodCount = 64;
+
+// 方法名对应的 llhttp 编号, 未知的方法返回 -1
+auto methodIndex(std::string_view method) -> int;
+
+// 规范化 URL 路径: 合并多余的 /, 去掉 . 和 .. 段, 保证以 / 开头, 保留结尾的 /
+auto cleanPath(const std::string &p) -> std::string;
+
+// handler 的执行方式
+enum class Execution
+{
+    Inline,     // 在事件循环线程上执行, 请求体读完后才调用, 不能阻塞
+    ThreadPool, // 在 handler 线程池上执行
+    Worker,     // 在独立的 worker 线程池上执行, 适合长时间阻塞的 handler
+};
+
+// 请求体交给 handler 的方式, Execution::Inline 的路由总是 Buffered
+enum class BodyMode
+{
+    Stream,   // 解析完请求头就执行 handler, 从 request_s::body 边到达边读取
+    Buffered, // 请求体完整到达后才执行 handler, request_s::data 指向连续的请求体
+};
+
+// 路由匹配结果, 在事件循环线程上得到, 再按 execution 执行 handlers
+struct Route
+{
+    // 指向路由树中的 handler 链, 注册完成后不再修改
+    const HandlerChain *handlers = nullptr;
+    // 匹配到的路由编号, 没有匹配到时为 -1, 用于按路由统计
+    int id = -1;
+    // 清理后的请求路径, params 的值指向这里
+    std::string path;
+    Params params;
+    Execution execution = Execution::ThreadPool;
+    BodyMode body = BodyMode::Stream;
+
+    void reset()
+    {
+        handlers = nullptr;
+        id = -1;
+        path.clear();
+        params.clear();
+        execution = Execution::ThreadPool;
+        body = BodyMode::Stream;
+    }
+};
+
 struct RouterGroup
 {
 public:
     auto group(std::string relativePath) -> RouterGroup *;
+    // 注册路由, Engine 已 freeze 时抛出 std::runtime_error
     void handle(const std::string &method, const std::string &path,
                 RouteHandler handler);
+    void handle(const std::string &method, const std::string &path,
+                RouteHandler handler, Execution execution);
+    void handle(const std::string &method, const std::string &path,
+                RouteHandler handler, Execution execution, BodyMode body);
     void use(Handler handler);
+    // 设置该分组及其子分组中路由的默认执行方式
+    void setExecution(Execution mode) { execution = mode; }
+    // 设置该分组及其子分组中路由的请求体交付方式
+    void setBodyMode(BodyMode mode) { bodyMode = mode; }
 
 protected:
-    std::unordered_map<std::string, node *> trees;
+    std::array<node *, MethodCount> trees{};
+    // freeze 编译出的只读路由表, 之后不能再注册路由
+    FrozenRoutes *frozen = nullptr;
     // HandlerChain handlers;
+    Execution execution;
+    BodyMode bodyMode;
 
-    RouterGroup(std::string relativePath, HandlerChain handlers, Engine *engine)
-        : basePath(std::move(relativePath)), handlers(std::move(handlers)),
-          engine(engine) {}
+    RouterGroup(std::string relativePath, HandlerChain handlers, Engine *engine,
+                Execution execution, BodyMode bodyMode)
+        : execution(execution), bodyMode(bodyMode),
+          basePath(std::move(relativePath)),
+          handlers(std::move(handlers)), engine(engine) {}
 
 private:
     std::string basePath;
@@ -48,211 +161,81 @@ private:
 struct Engine : public RouterGroup
 {
 public:
-    Engine() : RouterGroup("", {}, this) {}
-    ~Engine() = default;
+    Engine();
+    ~Engine();
+
+    // 把路由树编译成紧凑的只读表, 之后的查找都使用它, 已编译时不做任何事.
+    // listen 和 ServeHTTP(req, res) 时自动调用, 不经过它们直接 match 时需先调用.
+    // 之后注册路由会抛出异常, 路由需在 listen 之前注册完.
+    // 节点的路径, 子节点数超过 65535 时抛出 std::runtime_error
+    void freeze();
+    auto isFrozen() const -> bool { return frozen != nullptr; }
 
     // void ServeHTTP(const std::string &method, const std::string &path);
+    // 查找并执行路由, 还没有 freeze 时先 freeze, 只用于单线程
     void ServeHTTP(request_s &req, response_s &res);
+    // 查找路由, 不执行 handler. 只读, 多个线程可以同时调用
+    void match(request_s &req, Route &route);
+    // 执行 match 得到的路由
+    void ServeHTTP(request_s &req, response_s &res, Route &route);
     void NoRoute(RouteHandler handler);
 
+    // freeze 时按注册的路由编号, 编号从 0 开始连续, 还没有 freeze 时为 0
+    auto routeCount() const -> size_t;
+    // 编号对应的方法和注册时的完整路径, 编号无效或还没有 freeze 时返回 false
+    auto routeName(int id, std::string_view &method,
+                   std::string_view &path) const -> bool;
+    // 启用请求追踪 (见 tracing.h), 为 nullptr 时停止. 可以在运行中切换,
+    // 切换前已开始的请求仍使用之前的 Tracer
+    void setTracer(Tracer *tracer);
+
 private:
-    Handler noroute;
+    HandlerChain noroute;
+    // 为空时不追踪, 处理请求的线程读取
+    std::atomic<Tracer *> tracer{nullptr};
+    // 内置的 404 和 405 handler
+    HandlerChain notfound;
+    HandlerChain notallowed;
+
+    // 其它方法下能匹配 path 的方法列表, 用于 405 的 Allow 响应头
+    auto allowedMethods(std::string_view path, int method) -> std::string;
 };
 
+// 一次请求的处理过程, 由 ServeHTTP 在栈上创建.
+// 处理链和路由参数都只是借用: 处理链属于路由树, 路由参数属于连接复用的 Route,
+// 所以创建 Context 不分配内存, 中间件再多也只是多几次调用
 struct Context
 {
 public:
-    // Context(
-    //     const std::string &method, const std::string &path, Params params,
-    //     HandlerChain handlerChain) : method(method), path(path),
-    //     params(params), handlerChain(handlerChain), index(-1) {}
-
-    Context(request_s *req, response_s *res, Params params,
-            HandlerChain handlerChain)
-        : req(req), res(res), params(std::move(params)),
-          handlerChain(std::move(handlerChain)), index(-1) {}
+    Context(request_s *req, response_s *res, const Params *params,
+            const HandlerChain *handlerChain)
+        : req(req), res(res), params(params), handlerChain(handlerChain),
+          index(-1) {}
+    // 执行位置只属于这一次请求, 不能复制
+    Context(const Context &) = delete;
+    auto operator=(const Context &) -> Context & = delete;
 
     void next();
     void abort();
-    auto getParam(const std::string &key, std::string &param) -> bool;
+    auto getParam(std::string_view key, std::string &param) -> bool;
+    // 获取路由参数, 不存在时返回空, 在请求处理完之前有效
+    auto getParam(std::string_view key) -> std::string_view;
     auto getRequest() -> request_s * { return req; }
     auto getResponse() -> response_s * { return res; }
 
 private:
+    friend struct Engine;
+
     request_s *req;
     response_s *res;
-    Params params;
-    HandlerChain handlerChain;
+    const Params *params;
+    const HandlerChain *handlerChain;
     size_t index = 0;
-};
-
-struct CaseInsensitiveHash {
-    size_t operator()(const std::string &key) const {
-        std::string lowerKey = key;
-        std::transform(lowerKey.begin(), lowerKey.end(), lowerKey.begin(), ::tolower);
-        return std::hash<std::string>()(lowerKey); // 使用标准库的哈希函数
-    }
-};
-
-struct CaseInsensitiveEqual {
-    bool operator()(const std::string &a, const std::string &b) const {
-        return std::equal(a.begin(), a.end(), b.begin(), b.end(),
-                          [](char c1, char c2) { return ::tolower(c1) == ::tolower(c2); });
-    }
-};
-
-
-struct response_s
-{
-private:
-    std::string http_version = "HTTP/1.1";                // 默认 HTTP 版本
-    int status_code = 200;                                // 默认状态码
-    std::string status_message = "OK";                    // 默认状态消息
-    std::unordered_map<std::string, std::string> headers; // 响应头
-    std::string body;                                     // 响应正文
-
-    // 获取默认状态消息
-    auto getDefaultStatusMessage(int code) -> std::string
-    {
-        switch (code)
-        {
-        case 100:
-            return "Continue";
-        case 201:
-            return "Created";
-        case 202:
-            return "Accepted";
-        case 204:
-            return "No Content";
-        case 206:
-            return "Partial Content";
-        case 301:
-            return "Moved Permanently";
-        case 302:
-            return "Found";
-        case 304:
-            return "Not Modified";
-        case 400:
-            return "Bad Request";
-        case 401:
-            return "Unauthorized";
-        case 403:
-            return "Forbidden";
-        case 404:
-            return "Not Found";
-        case 416:
-            return "Range Not Satisfiable";
-        case 418:
-            return "I'm a teapot";
-        case 500:
-            return "Internal Server Error";
-        case 501:
-            return "Not Implemented";
-        default:
-            return "Unknown";
-        }
-    }
-
-public:
-    // 设置 HTTP 版本
-    auto setVersion(const std::string &version) -> response_s *
-    {
-        http_version = version;
-        return this;
-    }
-
-    // 设置状态码和状态消息
-    auto setStatus(int code, const std::string &message = "") -> response_s *
-    {
-        status_code = code;
-        status_message =
-            message.empty() ? getDefaultStatusMessage(code) : message;
-        return this;
-    }
-
-    auto getStatus() -> int { return status_code; }
-
-    // 添加响应头
-    auto addHeader(const std::string &key,
-                   const std::string &value) -> response_s *
-    {
-        headers[key] = value;
-        return this;
-    }
-
-    // 设置响应正文
-    auto setBody(const std::string &response_body) -> response_s *
-    {
-        body = response_body;
-        addHeader("Content-Length",
-                  std::to_string(body.size())); // 自动设置 Content-Length
-        return this;
-    }
-
-    // 构建完整的响应字符串
-    auto build(char *&buf) const -> int
-    {
-        // 1. 计算所需的总缓冲区大小
-        size_t total_size = 0;
-
-        // 起始行长度: "HTTP/1.1 200 OK\r\n"
-        total_size += http_version.size() + 1 +
-                      std::to_string(status_code).size() + 1 +
-                      status_message.size() + 2;
-
-        // 每个头部的长度: "Key: Value\r\n"
-        for (const auto &[key, value] : headers)
-        {
-            total_size += key.size() + 2 + value.size() + 2;
-        }
-
-        // 空行（分隔头部和正文）
-        total_size += 2;
-
-        // 正文的长度
-        total_size += body.size();
-
-        // 2. 分配内存：+1 用于字符串结束符 '\0'
-        buf = new char[total_size + 1];
-        char *write_ptr = buf;
-
-        // 3. 构建 HTTP 响应字符串
 
-        // 写入起始行
-        write_ptr +=
-            std::sprintf(write_ptr, "%s %d %s\r\n", http_version.c_str(),
-                         status_code, status_message.c_str());
+    // 这个请求被采样时由 Engine 设置, 为空时不记录
+    Tracer *tracer = nullptr;
+    uint64_t request = 0;
+    int route = -1;
 
-        // 写入头部
-        for (const auto &[key, value] : headers)
-        {
-            write_ptr += std::sprintf(write_ptr, "%s: %s\r\n", key.c_str(),
-                                      value.c_str());
-        }
-
-        // 写入空行
-        write_ptr += std::sprintf(write_ptr, "\r\n");
-
-        // 写入正文
-        if (!body.empty())
-        {
-            memcpy(write_ptr, body.c_str(), body.size());
-            write_ptr += body.size();
-        }
-
-        // 添加终止符 '\0'
-        *write_ptr = '\0';
-
-        // 4. 返回实际字符串长度
-        return static_cast<int>(total_size);
-    }
-};
-
-struct request_s
-{
-    std::string method;
-    std::string url;
-    std::string version;
-    std::unordered_map<std::string, std::string, CaseInsensitiveHash, CaseInsensitiveEqual> headers;
-    std::istream *body;
+    void traceNext();
 };
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class Tracer;
+
+// 请求追踪: 按采样率选出请求, 记录处理链中每个中间件和 handler 的调用区间,
+// 时间戳取自 TSC. 每个线程写入自己的环形缓冲区, 不加锁, 写满后覆盖最早的记录,
+// 保留的是最近的请求. 通过 Engine::setTracer 启用, 没有设置时
+// Context::next 只多一次恒为假的判断
+
+// every 个请求中记录一个, 为 1 时记录全部. capacity 是每个线程保留的区间数,
+// 向上取到 2 的幂
+auto trace_open(Tracer **tracer, unsigned int every = 100,
+                size_t capacity = 65536) -> int;
+// 修改采样率, 可以在运行中调用
+auto trace_sample(Tracer *tracer, unsigned int every) -> int;
+// 把各线程缓冲区中的区间以 Chrome trace event JSON 追加到 out,
+// 可用 chrome://tracing 或 Perfetto 打开. 可以在运行中调用
+auto trace_export(Tracer *tracer, std::string &out) -> int;
+// 释放, 需先用 Engine::setTracer(nullptr) 停止记录并等请求处理完
+void trace_close(Tracer *tracer);
@@ -0,0 +1,109 @@
+#include "executor.h"
+#include "gin.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+Executor::Executor(unsigned int nthreads, const int *cpus, unsigned int ncpus)
+{
+    if (nthreads == 0)
+    {
+        nthreads = 1;
+    }
+    for (unsigned int i = 0; i < nthreads; i++)
+    {
+        workers.emplace_back(new worker_s());
+    }
+
+    for (unsigned int i = 0; i < nthreads; i++)
+    {
+        auto &thread = workers[i]->thread;
+        thread = std::thread([this, i]() { run(i); });
+
+#ifdef __linux__
+        if (cpus != nullptr && ncpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % ncpus], &set);
+            // 绑定失败 (如 CPU 不存在) 时线程照常运行
+            pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+        }
+#endif
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    for (auto &worker : workers)
+    {
+        worker->thread.join();
+    }
+}
+
+void Executor::submit(uv_http_task_s *task)
+{
+    // 轮流放入各线程的队列, 忙的线程的任务会被空闲线程窃取
+    auto &worker = *workers[next.fetch_add(1) % workers.size()];
+    queued.fetch_add(1);
+    {
+        std::unique_lock<std::mutex> lock(worker.mtx);
+        worker.tasks.push_back(task);
+    }
+
+    // 只有在有线程休眠时才需要加锁唤醒
+    if (sleeping.load() > 0)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.notify_one();
+    }
+}
+
+// 先取自己队列的队首, 再按顺序从其它队列窃取, 都取最早提交的任务
+auto Executor::pop(unsigned int self) -> uv_http_task_s *
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        auto &worker = *workers[(self + i) % workers.size()];
+        std::unique_lock<std::mutex> lock(worker.mtx);
+        if (!worker.tasks.empty())
+        {
+            uv_http_task_s *task = worker.tasks.front();
+            worker.tasks.pop_front();
+            queued.fetch_sub(1);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void Executor::run(unsigned int self)
+{
+    while (true)
+    {
+        uv_http_task_s *task = pop(self);
+        if (task == nullptr)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            sleeping.fetch_add(1);
+            cv.wait(lock, [this]() { return queued.load() > 0 || stopping; });
+            sleeping.fetch_sub(1);
+            if (queued.load() == 0 && stopping)
+            {
+                return;
+            }
+            continue;
+        }
+
+        task->work(task);
+        task_complete(task);
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct uv_http_task_s;
+
+// 独立于 libuv 线程池的 handler 线程池, 每个线程有自己的任务队列,
+// 自己的队列为空时从其它线程的队列中窃取任务
+class Executor
+{
+private:
+    struct worker_s
+    {
+        std::mutex mtx;
+        std::deque<uv_http_task_s *> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker_s>> workers;
+    // 所有队列中的任务总数
+    std::atomic<unsigned int> queued{0};
+    // 下一个任务放入的队列
+    std::atomic<unsigned int> next{0};
+
+    // 没有任务时线程在 cv 上休眠
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::atomic<unsigned int> sleeping{0};
+    bool stopping = false;
+
+    auto pop(unsigned int self) -> uv_http_task_s *;
+    void run(unsigned int self);
+
+public:
+    // cpus 不为空时第 i 个线程绑定到 cpus[i % ncpus]
+    Executor(unsigned int nthreads, const int *cpus, unsigned int ncpus);
+    ~Executor();
+
+    void submit(uv_http_task_s *task);
+};
+
+// 任务在 worker 线程上执行完后调用, 把任务交回提交它的事件循环
+void task_complete(uv_http_task_s *task);
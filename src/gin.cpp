@@ -1,11 +1,34 @@
 #include "gin.h"
+#include "executor.h"
+#include "metrics.h"
 #include "reader.h"
 #include "router.h"
+#include "writer.h"
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <streambuf>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// 每个事件循环最多留着复用的已关闭连接数
+constexpr unsigned int MaxFreeConns = 128;
+// 小于 SmallBodyChunk 的请求体数据块拷贝到连接保留的缓冲区,
+// 不引用整个读缓冲区, 保留的缓冲区大小为 RetainedBufferSize
+constexpr size_t SmallBodyChunk = 4 * 1024;
+constexpr size_t RetainedBufferSize = 16 * 1024;
+// 复用请求时完整读取的请求体最多保留的容量
+constexpr size_t MaxRetainedBody = 64 * 1024;
 
 #if !defined(container_of)
 #if defined(__GNUC__) || defined(__clang__)
@@ -31,13 +54,53 @@ auto onmethod(llhttp_t *parser, const char *at, size_t length) -> int;
 auto onversion(llhttp_t *parser, const char *at, size_t length) -> int;
 auto onheaderfield(llhttp_t *parser, const char *at, size_t length) -> int;
 auto onheadervalue(llhttp_t *parser, const char *at, size_t length) -> int;
+auto onurlcomplete(llhttp_t *parser) -> int;
+auto onmethodcomplete(llhttp_t *parser) -> int;
+auto onversioncomplete(llhttp_t *parser) -> int;
+auto onheaderfieldcomplete(llhttp_t *parser) -> int;
+auto onheadervaluecomplete(llhttp_t *parser) -> int;
 auto onheaderscomplete(llhttp_t *parser) -> int;
 auto onbody(llhttp_t *parser, const char *at, size_t length) -> int;
 auto onmessagecomplete(llhttp_t *parser) -> int;
 void defaulthttpcb(uv_http_conn_s *conn, uv_http_event_t event, void *data);
 void httpcb(uv_http_conn_s *conn, uv_http_event_t event, void *data);
 void write_cb(uv_write_t *req, int status);
+void ontimeout(uv_timer_t *handle);
+void request_execute(uv_http_conn_s *conn, ReadBuffer *buf, const char *data,
+                     size_t length);
+auto body_retain(uv_http_conn_s *conn, const char *data, size_t length)
+    -> ReadBuffer *;
+void request_flush(uv_http_conn_s *conn);
+void request_written(uv_http_conn_s *conn, unsigned int written);
+void request_resume(uv_http_conn_s *conn);
+void request_read(uv_http_conn_s *conn);
+void request_unthrottle(uv_http_conn_s *conn);
 void request_close(uv_http_conn_s *conn);
+void request_release(uv_http_conn_s *conn);
+void conn_recycle(uv_http_conn_s *conn);
+void conn_free(uv_http_conn_s *conn);
+auto message_acquire(uv_http_conn_s *conn) -> uv_http_message_s *;
+void message_recycle(uv_http_conn_s *conn, uv_http_message_s *msg);
+void message_free(uv_http_message_s *msg);
+void message_serve(uv_http_message_s *msg);
+void message_dispatch(uv_http_message_s *msg);
+void message_reject(uv_http_message_s *msg);
+void message_done(uv_http_message_s *msg);
+void stream_arm(uv_http_message_s *msg);
+void stream_notify(void *arg);
+void http_shutdown(uv_http_s *http);
+void init_abort(uv_http_s *http, bool timer);
+void shards_stop(uv_http_s *http);
+void listen_abort(uv_http_s *http);
+void date_update(uv_timer_t *handle);
+void onstop(uv_async_t *handle);
+auto executor_create(Executor **executor, unsigned int nthreads,
+                     const int *cpus, unsigned int ncpus) -> int;
+void task_hold(uv_http_s *http);
+void task_cancel(uv_http_s *http);
+void task_submit(uv_http_s *http, Executor *executor, uv_http_task_s *task);
+void oncompleted(uv_async_t *handle);
+void completed_close(uv_http_s *http);
 // void request_done_async(uv_async_t *handle);
 
 auto uv_http_init(uv_http_s *http, uv_loop_s *loop, Engine *engine) -> int
@@ -45,10 +108,292 @@ auto uv_http_init(uv_http_s *http, uv_loop_s *loop, Engine *engine) -> int
     http->loop = loop;
     // http->cb = cb;
     http->engine = engine;
-    int err = uv_tcp_init(loop, &http->server);
+    http->keepalive_timeout = 5000;
+    http->max_requests = 1000;
+    http->max_pipeline = 16;
+    http->max_header_size = 8192;
+    http->body_high_water = 256 * 1024;
+    http->body_low_water = 64 * 1024;
+    http->max_body_size = 1024 * 1024;
+    http->write_high_water = 256 * 1024;
+    http->read_buffer_size = 64 * 1024;
+    http->read_buffer_count = 64;
+    http->readpool =
+        new ReadBufferPool(http->read_buffer_size, http->read_buffer_count);
+    http->server_header.clear();
+    http->metrics_enabled = false;
+    http->metrics = nullptr;
+    http->shards.clear();
+    http->parent = nullptr;
+    http->conns = nullptr;
+    http->freeconns = nullptr;
+    http->nfreeconns = 0;
+    http->stopping = false;
+
+    http->executor = nullptr;
+    http->workers = nullptr;
+    http->completed_head = nullptr;
+    http->tasks = 0;
+    int err = uv_async_init(loop, &http->completed, oncompleted);
+    if (err)
+    {
+        return err;
+    }
+    // 只有在有任务未完成时才让 async 保持事件循环运行
+    uv_unref((uv_handle_t *)&http->completed);
+    uv_mutex_init(&http->completed_mutex);
+
+    // Date 头部每秒生成一次, 各响应直接引用
+    err = uv_timer_init(loop, &http->date_timer);
+    if (err)
+    {
+        init_abort(http, false);
+        return err;
+    }
+    date_update(&http->date_timer);
+    uv_timer_start(&http->date_timer, date_update, 1000, 1000);
+    uv_unref((uv_handle_t *)&http->date_timer);
+
+    err = uv_tcp_init(loop, &http->server);
+    if (err)
+    {
+        init_abort(http, true);
+    }
     return err;
 }
 
+// uv_http_init 失败时关闭已创建的句柄, 运行事件循环后关闭回调才执行完
+void init_abort(uv_http_s *http, bool timer)
+{
+    uv_close((uv_handle_t *)&http->completed,
+             [](uv_handle_t *handle)
+             {
+                 uv_http_s *http = container_of(
+                     (uv_async_t *)handle, uv_http_s, completed);
+                 uv_mutex_destroy(&http->completed_mutex);
+             });
+    if (timer)
+    {
+        uv_close((uv_handle_t *)&http->date_timer, nullptr);
+    }
+    http->readpool->close();
+    http->readpool = nullptr;
+}
+
+// 按 RFC 9110 的 IMF-fixdate 格式生成 Date 头部, 不受 locale 影响
+void date_update(uv_timer_t *handle)
+{
+    static const char *const days[] = {"Sun", "Mon", "Tue", "Wed",
+                                       "Thu", "Fri", "Sat"};
+    static const char *const months[] = {"Jan", "Feb", "Mar", "Apr",
+                                         "May", "Jun", "Jul", "Aug",
+                                         "Sep", "Oct", "Nov", "Dec"};
+
+    uv_http_s *http = container_of(handle, uv_http_s, date_timer);
+    time_t now = time(nullptr);
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf),
+                       "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                       days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+                       tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    http->date_header.assign(buf, len);
+}
+
+auto uv_http_keepalive(uv_http_s *http, uint64_t timeout,
+                       unsigned int max_requests) -> int
+{
+    http->keepalive_timeout = timeout;
+    http->max_requests = max_requests;
+    return 0;
+}
+
+auto uv_http_pipeline(uv_http_s *http, unsigned int depth) -> int
+{
+    if (depth == 0)
+    {
+        return UV_EINVAL;
+    }
+    http->max_pipeline = depth;
+    return 0;
+}
+
+auto uv_http_header_limit(uv_http_s *http, size_t size) -> int
+{
+    if (size == 0)
+    {
+        return UV_EINVAL;
+    }
+    http->max_header_size = size;
+    return 0;
+}
+
+auto uv_http_body_buffer(uv_http_s *http, size_t high, size_t low) -> int
+{
+    if (high == 0 || low > high)
+    {
+        return UV_EINVAL;
+    }
+    http->body_high_water = high;
+    http->body_low_water = low;
+    return 0;
+}
+
+auto uv_http_body_limit(uv_http_s *http, size_t size) -> int
+{
+    if (size == 0)
+    {
+        return UV_EINVAL;
+    }
+    http->max_body_size = size;
+    return 0;
+}
+
+auto uv_http_response_buffer(uv_http_s *http, size_t size) -> int
+{
+    if (size == 0)
+    {
+        return UV_EINVAL;
+    }
+    http->write_high_water = size;
+    return 0;
+}
+
+auto executor_create(Executor **executor, unsigned int nthreads,
+                     const int *cpus, unsigned int ncpus) -> int
+{
+    if (*executor != nullptr)
+    {
+        return UV_EBUSY;
+    }
+    if (nthreads == 0)
+    {
+        nthreads = uv_available_parallelism();
+    }
+    *executor = new Executor(nthreads, cpus, ncpus);
+    return 0;
+}
+
+// 与 libuv 线程池默认大小一致, 至少 4 个线程, 避免少数阻塞的 handler 占满线程池
+auto default_threads() -> unsigned int
+{
+    return std::max(4u, uv_available_parallelism());
+}
+
+auto uv_http_read_buffer(uv_http_s *http, size_t size, unsigned int count)
+    -> int
+{
+    if (size == 0)
+    {
+        return UV_EINVAL;
+    }
+    http->read_buffer_size = size;
+    http->read_buffer_count = count;
+    if (http->readpool != nullptr)
+    {
+        http->readpool->configure(size, count);
+    }
+    return 0;
+}
+
+auto uv_http_read_stats(uv_http_s *http, uv_http_read_stats_s *stats) -> int
+{
+    *stats = {};
+    auto add = [stats](uv_http_s *loop)
+    {
+        if (loop->readpool != nullptr)
+        {
+            stats->hits += loop->readpool->hitCount();
+            stats->misses += loop->readpool->missCount();
+            stats->cached += loop->readpool->cached();
+        }
+    };
+    add(http);
+    for (auto *shard : http->shards)
+    {
+        add(shard);
+    }
+    return 0;
+}
+
+auto uv_http_server_name(uv_http_s *http, const char *name) -> int
+{
+    http->server_header.clear();
+    if (name != nullptr && *name != '\0')
+    {
+        http->server_header.append("Server: ").append(name).append("\r\n");
+    }
+    return 0;
+}
+
+auto uv_http_metrics(uv_http_s *http) -> int
+{
+    http->metrics_enabled = true;
+    return 0;
+}
+
+// 路由编号在 freeze 之后才确定, listen 时创建
+void metrics_create(uv_http_s *http)
+{
+    if (http->metrics_enabled && http->metrics == nullptr)
+    {
+        http->metrics = new Metrics(http->engine);
+    }
+}
+
+auto uv_http_metrics_render(uv_http_s *http, std::string &out) -> int
+{
+    if (http->metrics == nullptr)
+    {
+        return UV_EINVAL;
+    }
+    http->metrics->render(out);
+    return 0;
+}
+
+auto uv_http_metrics_route(uv_http_s *http, const std::string &path) -> int
+{
+    // listen 之后路由表已编译, 不能再注册路由
+    if (http->engine->isFrozen())
+    {
+        return UV_EBUSY;
+    }
+    http->metrics_enabled = true;
+    http->engine->handle(
+        "GET", path,
+        [http](request_s *, response_s *res, Context *)
+        {
+            std::string body;
+            if (uv_http_metrics_render(http, body))
+            {
+                res->setStatus(503)->setBody("503 Service Unavailable");
+                return;
+            }
+            res->setStatus(200)
+                ->addHeader("Content-Type", "text/plain; version=0.0.4")
+                ->setBody(std::move(body));
+        });
+    return 0;
+}
+
+auto uv_http_threads(uv_http_s *http, unsigned int nthreads, const int *cpus,
+                     unsigned int ncpus) -> int
+{
+    return executor_create(&http->executor, nthreads, cpus, ncpus);
+}
+
+auto uv_http_workers(uv_http_s *http, unsigned int nthreads, const int *cpus,
+                     unsigned int ncpus) -> int
+{
+    return executor_create(&http->workers, nthreads, cpus, ncpus);
+}
+
 auto uv_http_listen(uv_http_s *http, const char *ip, int port) -> int
 {
     struct sockaddr_in addr;
@@ -58,60 +403,776 @@ auto uv_http_listen(uv_http_s *http, const char *ip, int port) -> int
         return err;
     }
 
-    err = uv_tcp_bind(&http->server, (const struct sockaddr *)&addr, 0);
-    if (err)
+    if (http->executor == nullptr)
+    {
+        executor_create(&http->executor, default_threads(), nullptr, 0);
+    }
+    // 在接受连接之前编译路由表, 之后各事件循环只读共享
+    http->engine->freeze();
+    metrics_create(http);
+
+    err = uv_tcp_bind(&http->server, (const struct sockaddr *)&addr, 0);
+    if (err)
+    {
+        return err;
+    }
+
+    err = uv_listen((uv_stream_t *)&http->server, SOMAXCONN, onconnection);
+    return err;
+}
+
+#ifndef _WIN32
+// 每个事件循环各自创建开启 SO_REUSEPORT 的监听 socket, 由内核分发连接
+auto listen_reuseport(uv_http_s *http, const struct sockaddr_in *addr) -> int
+{
+#ifdef SO_REUSEPORT
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0)
+    {
+        int err = uv_translate_sys_error(errno);
+        close(fd);
+        return err;
+    }
+
+    int err = uv_tcp_open(&http->server, fd);
+    if (err)
+    {
+        close(fd);
+        return err;
+    }
+
+    return uv_listen((uv_stream_t *)&http->server, SOMAXCONN, onconnection);
+#else
+    return UV_ENOPROTOOPT;
+#endif
+}
+
+// 不支持 SO_REUSEPORT 时, 所有事件循环共用第一个事件循环的监听 socket
+auto listen_shared(uv_http_s *http, uv_http_s *parent) -> int
+{
+    uv_os_fd_t fd;
+    int err = uv_fileno((uv_handle_t *)&parent->server, &fd);
+    if (err)
+    {
+        return err;
+    }
+
+    int dupfd = dup(fd);
+    if (dupfd < 0)
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    err = uv_tcp_open(&http->server, dupfd);
+    if (err)
+    {
+        close(dupfd);
+        return err;
+    }
+
+    return uv_listen((uv_stream_t *)&http->server, SOMAXCONN, onconnection);
+}
+
+void shard_run(void *arg)
+{
+    auto *http = static_cast<uv_http_s *>(arg);
+    uv_run(http->loop, UV_RUN_DEFAULT);
+    uv_loop_close(http->loop);
+    http->parent->wg.done();
+}
+#endif
+
+auto uv_http_listen_multi(uv_http_s *http, const char *ip, int port,
+                          int nloops) -> int
+{
+#ifdef _WIN32
+    if (nloops > 1)
+    {
+        return UV_ENOTSUP;
+    }
+    return uv_http_listen(http, ip, port);
+#else
+    if (nloops <= 0)
+    {
+        nloops = static_cast<int>(uv_available_parallelism());
+    }
+
+    struct sockaddr_in addr;
+    int err = uv_ip4_addr(ip, port, &addr);
+    if (err)
+    {
+        return err;
+    }
+
+    if (http->executor == nullptr)
+    {
+        executor_create(&http->executor, default_threads(), nullptr, 0);
+    }
+    // 在接受连接之前编译路由表, 之后各事件循环只读共享
+    http->engine->freeze();
+    metrics_create(http);
+
+    bool reuseport = true;
+    err = listen_reuseport(http, &addr);
+    if (err == UV_ENOPROTOOPT)
+    {
+        reuseport = false;
+        err = uv_http_listen(http, ip, port);
+    }
+    if (err)
+    {
+        return err;
+    }
+
+    for (int i = 1; i < nloops; i++)
+    {
+        auto *loop = new uv_loop_s();
+        err = uv_loop_init(loop);
+        if (err)
+        {
+            delete loop;
+            listen_abort(http);
+            return err;
+        }
+
+        // 各事件循环共享同一个只读的 Engine
+        auto *shard = new uv_http_s();
+        err = uv_http_init(shard, loop, http->engine);
+        if (!err)
+        {
+            shard->keepalive_timeout = http->keepalive_timeout;
+            shard->max_requests = http->max_requests;
+            shard->max_pipeline = http->max_pipeline;
+            shard->max_header_size = http->max_header_size;
+            shard->body_high_water = http->body_high_water;
+            shard->body_low_water = http->body_low_water;
+            shard->max_body_size = http->max_body_size;
+            shard->write_high_water = http->write_high_water;
+            uv_http_read_buffer(shard, http->read_buffer_size,
+                                http->read_buffer_count);
+            shard->server_header = http->server_header;
+            shard->metrics = http->metrics;
+            shard->executor = http->executor;
+            shard->workers = http->workers;
+            shard->parent = http;
+
+            err = reuseport ? listen_reuseport(shard, &addr)
+                            : listen_shared(shard, http);
+            bool stoppable = false;
+            if (!err)
+            {
+                err = uv_async_init(loop, &shard->stop, onstop);
+                stoppable = !err;
+            }
+            if (!err)
+            {
+                http->wg.add(1);
+                err = uv_thread_create(&shard->thread, shard_run, shard);
+                if (err)
+                {
+                    http->wg.done();
+                }
+            }
+            if (err)
+            {
+                // 关闭 uv_http_init 创建的所有句柄
+                if (stoppable)
+                {
+                    uv_close((uv_handle_t *)&shard->stop, nullptr);
+                }
+                http_shutdown(shard);
+            }
+        }
+        if (err)
+        {
+            // 句柄的关闭回调执行完后才能释放. 仍有句柄时不释放,
+            // 以免释放还在使用的内存
+            uv_run(loop, UV_RUN_DEFAULT);
+            if (uv_loop_close(loop) == 0)
+            {
+                delete loop;
+                delete shard;
+            }
+            listen_abort(http);
+            return err;
+        }
+        http->shards.push_back(shard);
+    }
+    return 0;
+#endif
+}
+
+// 停止接受新连接, 关闭空闲连接, 其余连接写完当前响应后关闭
+void http_shutdown(uv_http_s *http)
+{
+    if (http->stopping)
+    {
+        return;
+    }
+    http->stopping = true;
+
+    if (!uv_is_closing((uv_handle_t *)&http->server))
+    {
+        uv_close((uv_handle_t *)&http->server, nullptr);
+    }
+    // 还在使用的读缓冲区归还时释放, 全部归还后池自行删除
+    if (http->readpool != nullptr)
+    {
+        http->readpool->close();
+        http->readpool = nullptr;
+    }
+    if (!uv_is_closing((uv_handle_t *)&http->date_timer))
+    {
+        uv_close((uv_handle_t *)&http->date_timer, nullptr);
+    }
+    if (http->tasks == 0)
+    {
+        completed_close(http);
+    }
+
+    while (http->freeconns != nullptr)
+    {
+        auto *conn = http->freeconns;
+        http->freeconns = conn->next;
+        conn_free(conn);
+    }
+    http->nfreeconns = 0;
+
+    for (auto *conn = http->conns; conn != nullptr; conn = conn->next)
+    {
+        if (conn->head == nullptr)
+        {
+            request_close(conn);
+        }
+    }
+}
+
+void onstop(uv_async_t *handle)
+{
+    uv_http_s *http = container_of(handle, uv_http_s, stop);
+    uv_close((uv_handle_t *)&http->stop, nullptr);
+    http_shutdown(http);
+}
+
+// uv_http_listen_multi 失败时停止已启动的其它事件循环并关闭第一个事件循环,
+// 返回错误时不再有任何事件循环在监听
+void listen_abort(uv_http_s *http)
+{
+    shards_stop(http);
+    http_shutdown(http);
+}
+
+// 停止 uv_http_listen_multi 启动的其它事件循环, 等它们处理完并退出
+void shards_stop(uv_http_s *http)
+{
+    for (auto *shard : http->shards)
+    {
+        uv_async_send(&shard->stop);
+    }
+    http->wg.wait();
+    for (auto *shard : http->shards)
+    {
+        uv_thread_join(&shard->thread);
+        delete shard->loop;
+        delete shard;
+    }
+    http->shards.clear();
+}
+
+// http_shutdown 操作第一个事件循环的句柄, 只能在它的线程上调用
+auto uv_http_stop(uv_http_s *http) -> int
+{
+    http_shutdown(http);
+    shards_stop(http);
+    return 0;
+}
+
+// 登记一个会通过 task_complete 回到事件循环的任务
+void task_hold(uv_http_s *http)
+{
+    if (http->tasks++ == 0)
+    {
+        uv_ref((uv_handle_t *)&http->completed);
+    }
+}
+
+// 登记过的任务不会再完成时撤销
+void task_cancel(uv_http_s *http)
+{
+    if (--http->tasks == 0)
+    {
+        if (http->stopping)
+        {
+            completed_close(http);
+        }
+        else
+        {
+            uv_unref((uv_handle_t *)&http->completed);
+        }
+    }
+}
+
+void task_submit(uv_http_s *http, Executor *executor, uv_http_task_s *task)
+{
+    task->http = http;
+    task_hold(http);
+    executor->submit(task);
+}
+
+void task_complete(uv_http_task_s *task)
+{
+    uv_http_s *http = task->http;
+    uv_mutex_lock(&http->completed_mutex);
+    // 链表不为空时事件循环已被唤醒还没处理, 不用再唤醒
+    bool wakeup = http->completed_head == nullptr;
+    task->next = http->completed_head;
+    http->completed_head = task;
+    uv_mutex_unlock(&http->completed_mutex);
+    if (wakeup)
+    {
+        uv_async_send(&http->completed);
+    }
+}
+
+void oncompleted(uv_async_t *handle)
+{
+    uv_http_s *http = container_of(handle, uv_http_s, completed);
+
+    uv_mutex_lock(&http->completed_mutex);
+    uv_http_task_s *task = http->completed_head;
+    http->completed_head = nullptr;
+    uv_mutex_unlock(&http->completed_mutex);
+
+    while (task != nullptr)
+    {
+        uv_http_task_s *next = task->next;
+        http->tasks--;
+        task->done(task);
+        task = next;
+    }
+
+    if (http->tasks == 0)
+    {
+        if (http->stopping)
+        {
+            completed_close(http);
+        }
+        else
+        {
+            uv_unref((uv_handle_t *)&http->completed);
+        }
+    }
+}
+
+// 所有任务都回到事件循环后才能关闭 async, 第一个事件循环同时释放线程池
+void completed_close(uv_http_s *http)
+{
+    if (uv_is_closing((uv_handle_t *)&http->completed))
+    {
+        return;
+    }
+    uv_close((uv_handle_t *)&http->completed,
+             [](uv_handle_t *handle)
+             {
+                 uv_http_s *http = container_of(
+                     (uv_async_t *)handle, uv_http_s, completed);
+                 uv_mutex_destroy(&http->completed_mutex);
+                 if (http->parent == nullptr)
+                 {
+                     delete http->executor;
+                     http->executor = nullptr;
+                     delete http->workers;
+                     http->workers = nullptr;
+                     delete http->metrics;
+                     http->metrics = nullptr;
+                 }
+             });
+}
+
+auto uv_http_conn_init(uv_http_conn_s *conn, uv_http_s *http) -> int
+{
+    llhttp_settings_init(&conn->settings);
+    conn->settings.on_message_begin = onmessagebegin;
+    conn->settings.on_url = onurl;
+    conn->settings.on_status = onstatus;
+    conn->settings.on_method = onmethod;
+    conn->settings.on_version = onversion;
+    conn->settings.on_header_field = onheaderfield;
+    conn->settings.on_header_value = onheadervalue;
+    conn->settings.on_url_complete = onurlcomplete;
+    conn->settings.on_method_complete = onmethodcomplete;
+    conn->settings.on_version_complete = onversioncomplete;
+    conn->settings.on_header_field_complete = onheaderfieldcomplete;
+    conn->settings.on_header_value_complete = onheadervaluecomplete;
+    conn->settings.on_headers_complete = onheaderscomplete;
+    conn->settings.on_body = onbody;
+    conn->settings.on_message_complete = onmessagecomplete;
+    llhttp_init(&conn->parser, HTTP_REQUEST, &conn->settings);
+
+    conn->http = http;
+    // 在 wait 之前设置好, handler 线程会读取
+    conn->resume.http = http;
+    conn->resume.done = [](uv_http_task_s *task)
+    { request_unthrottle(container_of(task, uv_http_conn_s, resume)); };
+
+    // int err = uv_async_init(http->loop, &conn->async, request_done_async);
+
+    int err = uv_timer_init(http->loop, &conn->timer);
+    if (err)
+    {
+        return err;
+    }
+    conn->timer.data = conn;
+    conn->refs++;
+
+    err = uv_tcp_init(http->loop, &conn->client);
+    if (err)
+    {
+        return err;
+    }
+    conn->client.data = conn;
+    conn->refs++;
+    return 0;
+}
+
+auto message_acquire(uv_http_conn_s *conn) -> uv_http_message_s *
+{
+    uv_http_message_s *msg = conn->spare;
+    if (msg != nullptr)
+    {
+        conn->spare = msg->next;
+        msg->next = nullptr;
+    }
+    else
+    {
+        msg = new uv_http_message_s();
+        msg->conn = conn;
+        msg->buf = new BodyStreambuf();
+        msg->databuf = new SpanStreambuf();
+        msg->writer = new ResponseWriter();
+        msg->flushtask.http = conn->http;
+        msg->flushtask.done = [](uv_http_task_s *task)
+        {
+            auto *msg = container_of(task, uv_http_message_s, flushtask);
+            uv_http_conn_s *conn = msg->conn;
+            if (!conn->closed)
+            {
+                stream_arm(msg);
+                request_flush(conn);
+            }
+            request_release(conn);
+        };
+        msg->request.body = new std::istream(msg->buf);
+    }
+    // 预留固定容量, 解析过程中不会重新分配, 已有的 string_view 保持有效
+    msg->head.reserve(conn->http->max_header_size);
+
+    if (conn->tail != nullptr)
+    {
+        conn->tail->next = msg;
+    }
+    else
+    {
+        conn->head = msg;
+    }
+    conn->tail = msg;
+    conn->queued++;
+    return msg;
+}
+
+// 重置请求, 放回连接的空闲链表
+void message_recycle(uv_http_conn_s *conn, uv_http_message_s *msg)
+{
+    msg->request.reset();
+    msg->head.clear();
+    msg->request.body->clear();
+    msg->response.reset();
+    msg->route.reset();
+    msg->buf->reset();
+    msg->request.body->rdbuf(msg->buf);
+    msg->buffered = false;
+    // 偶尔的大请求体不长期占用空闲请求的内存
+    if (msg->data.capacity() > MaxRetainedBody)
+    {
+        std::string().swap(msg->data);
+    }
+    msg->data.clear();
+    msg->writer->reset();
+    msg->sending.clear();
+    msg->inflight = 0;
+    msg->headsent = false;
+    msg->finished = false;
+    msg->received = 0;
+    msg->submitted = 0;
+    msg->sent = 0;
+    msg->keepalive = false;
+    msg->complete = false;
+    msg->done = false;
+
+    msg->next = conn->spare;
+    conn->spare = msg;
+}
+
+void message_free(uv_http_message_s *msg)
+{
+    delete msg->buf;
+    delete msg->databuf;
+    delete msg->writer;
+    delete msg->request.body;
+    delete msg;
+}
+
+void message_serve(uv_http_message_s *msg)
+{
+    Metrics *metrics = msg->conn->http->metrics;
+    if (metrics == nullptr)
+    {
+        httpcb(msg->conn, UV_HTTP_MESSAGE, msg);
+        return;
+    }
+
+    uint64_t start = uv_hrtime();
+    if (msg->submitted != 0)
+    {
+        metrics->record(Metrics::Queue, msg->route.id, start - msg->submitted);
+    }
+    httpcb(msg->conn, UV_HTTP_MESSAGE, msg);
+    metrics->record(Metrics::Handler, msg->route.id, uv_hrtime() - start);
+}
+
+// 按路由的执行方式执行 handler
+void message_dispatch(uv_http_message_s *msg)
+{
+    auto *http = msg->conn->http;
+    switch (msg->route.execution)
+    {
+    case Execution::Inline:
+        message_serve(msg);
+        message_done(msg);
+        break;
+    case Execution::Worker:
+    case Execution::ThreadPool:
+        // HTTP/1.0 的客户端不支持 chunked
+        msg->writer->start(msg->request.version != "1.0",
+                           http->write_high_water, stream_notify, msg);
+        msg->response.setStream(msg->writer);
+        stream_arm(msg);
+        msg->task.work = [](uv_http_task_s *task)
+        { message_serve(container_of(task, uv_http_message_s, task)); };
+        msg->task.done = [](uv_http_task_s *task)
+        { message_done(container_of(task, uv_http_message_s, task)); };
+        if (http->metrics != nullptr)
+        {
+            msg->submitted = uv_hrtime();
+        }
+        // 没有 worker 线程池时在 handler 线程池上执行
+        task_submit(http,
+                    msg->route.execution == Execution::Worker &&
+                            http->workers != nullptr
+                        ? http->workers
+                        : http->executor,
+                    &msg->task);
+        break;
+    }
+}
+
+// handler 线程写入了流式响应的数据
+void stream_notify(void *arg)
+{
+    task_complete(&static_cast<uv_http_message_s *>(arg)->flushtask);
+}
+
+// 允许 handler 通知一次事件循环, 通知回来之前持有连接
+void stream_arm(uv_http_message_s *msg)
+{
+    if (!msg->done && msg->writer->arm())
+    {
+        task_hold(msg->conn->http);
+        msg->conn->refs++;
+    }
+}
+
+// 请求体超过 max_body_size, 不执行 handler, 直接响应 413.
+// 请求体没有读完, 响应写出后关闭连接
+void message_reject(uv_http_message_s *msg)
+{
+    msg->response.setStatus(413)
+        ->addHeader("Content-Type", "text/plain")
+        ->setBody("413 Payload Too Large");
+    msg->data.clear();
+    message_done(msg);
+}
+
+// handler 执行完, 回到事件循环线程上按顺序写出响应
+void message_done(uv_http_message_s *msg)
+{
+    uv_http_conn_s *conn = msg->conn;
+    msg->done = true;
+
+    // handler 没有读完的请求体不再需要, 因它积压而暂停的读取随之恢复
+    if (!msg->buffered && msg->buf->abandon())
+    {
+        task_cancel(conn->http);
+        request_unthrottle(conn);
+    }
+
+    // handler 已返回, 不会再通知, 没有结束的流式响应在这里结束
+    if (msg->writer->disarm())
+    {
+        task_cancel(conn->http);
+        conn->refs--;
+    }
+    if (msg->writer->isStarted())
+    {
+        msg->writer->end();
+    }
+
+    bool closed = conn->closed;
+    request_release(conn);
+    if (closed)
+    {
+        return;
+    }
+
+    request_flush(conn);
+}
+
+// 按到达顺序把队首已完成的响应合并成一次 uv_write 写出
+void request_flush(uv_http_conn_s *conn)
+{
+    if (conn->writing > 0 || conn->closed)
+    {
+        return;
+    }
+
+    // 响应头先追加到 headbuf, 对应的 buf 暂时只记长度, 全部追加完
+    // (headbuf 不再重新分配) 之后再填入地址
+    std::string &headbuf = conn->headbuf;
+    std::vector<uv_buf_t> &bufs = conn->bufs;
+    headbuf.clear();
+    bufs.clear();
+    unsigned int count = 0;
+    for (auto *msg = conn->head; msg != nullptr; msg = msg->next)
     {
-        return err;
-    }
+        // 流式响应在 handler 返回之前就开始写出
+        bool streaming = msg->writer->isStarted();
+        if (!streaming && !msg->done)
+        {
+            break;
+        }
 
-    err = uv_listen((uv_stream_t *)&http->server, SOMAXCONN, onconnection);
-    return err;
-}
+        if (!msg->headsent)
+        {
+            // 请求体还没读完就已经响应, 剩余数据无法安全跳过, 响应后关闭连接.
+            // 不使用 chunked 的流式响应以关闭连接结束
+            std::string connection;
+            if (!msg->complete || conn->http->stopping ||
+                (msg->response.getHeader("Connection", connection) &&
+                 connection == "close") ||
+                (streaming && !msg->writer->isChunked()))
+            {
+                msg->keepalive = false;
+            }
 
-auto uv_http_conn_init(uv_http_conn_s *conn, uv_http_s *http) -> int
-{
-    llhttp_settings_init(&conn->settings);
-    conn->settings.on_message_begin = onmessagebegin;
-    conn->settings.on_url = onurl;
-    conn->settings.on_status = onstatus;
-    conn->settings.on_method = onmethod;
-    conn->settings.on_version = onversion;
-    conn->settings.on_header_field = onheaderfield;
-    conn->settings.on_header_value = onheadervalue;
-    conn->settings.on_headers_complete = onheaderscomplete;
-    conn->settings.on_body = onbody;
-    conn->settings.on_message_complete = onmessagecomplete;
-    llhttp_init(&conn->parser, HTTP_REQUEST, &conn->settings);
+            if (!msg->keepalive)
+            {
+                msg->response.addHeader("Connection", "close");
+            }
+            else if (msg->request.version == "1.0")
+            {
+                msg->response.addHeader("Connection", "keep-alive");
+            }
 
-    conn->buf = new ThreadSafeReaderStreambuf(1024);
-    conn->request.body = new std::istream(conn->buf);
-    conn->http = http;
+            if (streaming)
+            {
+                msg->response.removeHeader("Content-Length");
+                if (msg->writer->isChunked())
+                {
+                    msg->response.addHeader("Transfer-Encoding", "chunked");
+                }
+            }
 
-    // int err = uv_async_init(http->loop, &conn->async, request_done_async);
+            Metrics *metrics = conn->http->metrics;
+            uint64_t serialize = metrics != nullptr ? uv_hrtime() : 0;
+            size_t start = headbuf.size();
+            msg->response.buildHead(headbuf, conn->http->date_header,
+                                    conn->http->server_header);
+            bufs.push_back(uv_buf_init(nullptr, headbuf.size() - start));
+            msg->headsent = true;
+            if (metrics != nullptr)
+            {
+                msg->sent = uv_hrtime();
+                metrics->record(Metrics::Serialize, msg->route.id,
+                                msg->sent - serialize);
+                metrics->status(msg->route.id, msg->response.getStatus());
+            }
 
-    return uv_tcp_init(http->loop, &conn->client);
-}
+            std::string_view body = msg->response.getBody();
+            if (!streaming && !body.empty())
+            {
+                bufs.push_back(
+                    uv_buf_init(const_cast<char *>(body.data()), body.size()));
+            }
+        }
+        count++;
 
-void request_done(uv_work_t *req, int status)
-{
-    uv_http_conn_s *conn = container_of(req, uv_http_conn_s, work);
+        if (streaming)
+        {
+            bool ended = msg->writer->take(msg->sending);
+            msg->inflight = msg->sending.size();
+            if (msg->inflight > 0)
+            {
+                bufs.push_back(uv_buf_init(&msg->sending[0], msg->inflight));
+            }
+            // 后面的响应要等这个响应写完
+            if (!ended)
+            {
+                break;
+            }
+            if (msg->writer->isFailed())
+            {
+                msg->keepalive = false;
+            }
+        }
+        msg->finished = true;
 
-    if (conn->closed)
+        if (!msg->keepalive)
+        {
+            break;
+        }
+    }
+
+    if (bufs.empty())
     {
-        request_close(conn);
+        // 不使用 chunked 的流式响应结束时没有数据要写出
+        if (count > 0 && conn->head->finished)
+        {
+            request_written(conn, count);
+        }
         return;
     }
 
-    int total_size = 0;
-    char *buf;
-    total_size = conn->response.build(buf);
-    conn->response_str = buf;
-
-    uv_buf_t resbuf = uv_buf_init(buf, total_size);
-    auto *req_write = new uv_write_t();
-    req_write->data = conn;
+    char *head = &headbuf[0];
+    for (auto &buf : bufs)
+    {
+        if (buf.base == nullptr)
+        {
+            buf.base = head;
+            head += buf.len;
+        }
+    }
 
-    uv_write(req_write, (uv_stream_t *)&conn->client, &resbuf, 1, write_cb);
+    conn->writing = count;
+    uv_write(&conn->write, (uv_stream_t *)&conn->client, bufs.data(),
+             bufs.size(), write_cb);
 }
 
 void onconnection(uv_stream_t *server, int status)
@@ -122,42 +1183,84 @@ void onconnection(uv_stream_t *server, int status)
     }
 
     uv_http_s *http = container_of((uv_tcp_t *)server, uv_http_s, server);
+    if (http->metrics != nullptr)
+    {
+        http->metrics->opened();
+    }
 
-    auto *client = new uv_http_conn_s(); //(uv_http_conn_s *)calloc(1,
-                                         // sizeof(uv_http_conn_s));
+    uv_http_conn_s *client = http->freeconns;
+    if (client != nullptr)
+    {
+        http->freeconns = client->next;
+        http->nfreeconns--;
+        client->next = nullptr;
+    }
+    else
+    {
+        client = new uv_http_conn_s();
+    }
     uv_http_conn_init(client, http);
 
+    client->next = http->conns;
+    if (http->conns != nullptr)
+    {
+        http->conns->prev = client;
+    }
+    http->conns = client;
+
     if (uv_accept(server, (uv_stream_t *)&client->client) == 0)
     {
         uv_read_start((uv_stream_t *)client, onalloc, onread);
+        if (http->keepalive_timeout > 0)
+        {
+            uv_timer_start(&client->timer, ontimeout, http->keepalive_timeout,
+                           0);
+        }
     }
     else
     {
-        uv_close((uv_handle_t *)client, nullptr);
+        request_close(client);
     }
 }
 
 void onalloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
 {
-    buf->base = (char *)malloc(suggested_size);
-    buf->len = suggested_size;
+    auto *conn = static_cast<uv_http_conn_s *>(handle->data);
+    ReadBufferPool *pool = conn->http->readpool;
+    // 停止之后不再使用缓冲区池
+    ReadBuffer *rb = pool != nullptr ? pool->acquire()
+                                     : ReadBuffer::create(suggested_size);
+    if (rb == nullptr)
+    {
+        // libuv 以 UV_ENOBUFS 调用 onread
+        *buf = uv_buf_init(nullptr, 0);
+        return;
+    }
+    *buf = uv_buf_init(rb->data(), rb->size);
 }
 
 void onread(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
 {
-    int ret;
     uv_http_conn_s *client =
         container_of((uv_tcp_t *)stream, uv_http_conn_s, client);
 
+    // 请求体的数据块可能还引用着缓冲区, 最后一个引用释放时才回收
+    ReadBuffer *rb = buf->base != nullptr ? ReadBuffer::of(buf->base) : nullptr;
+
     if (nread > 0)
     {
-        ret = llhttp_execute(&client->parser, buf->base, nread);
-        if (ret != HPE_OK)
+        if (client->http->metrics != nullptr)
         {
-            httpcb(client, UV_HTTP_ERROR,
-                   (void *)llhttp_errno_name((llhttp_errno_t)ret));
-            request_close(client);
+            client->http->metrics->received(nread);
         }
+        request_execute(client, rb, buf->base, nread);
+    }
+    else if (nread == UV_EOF && client->head != nullptr &&
+             client->parsing == nullptr)
+    {
+        // 对端半关闭, 写完已收到请求的响应后再关闭
+        client->eof = true;
+        uv_read_stop(stream);
     }
     else if (nread < 0)
     {
@@ -165,19 +1268,164 @@ void onread(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
         request_close(client);
     }
 
-    free(buf->base);
+    if (rb != nullptr)
+    {
+        rb->unref();
+    }
+}
+
+void request_execute(uv_http_conn_s *conn, ReadBuffer *buf, const char *data,
+                     size_t length)
+{
+    conn->reading = buf;
+    auto ret = llhttp_execute(&conn->parser, data, length);
+    conn->reading = nullptr;
+    if (ret == HPE_PAUSED)
+    {
+        // 队列已满或需要关闭连接, 暂停读取, 剩余数据留到队列有空位后再解析.
+        // 暂停后不会再读到新数据, 只需引用这一块
+        const char *pos = llhttp_get_error_pos(&conn->parser);
+        if (pos < data + length)
+        {
+            buf->ref();
+            conn->pending = buf;
+            conn->pendingdata = pos;
+            conn->pendinglen = data + length - pos;
+        }
+        if (!conn->paused)
+        {
+            conn->paused = true;
+            uv_read_stop((uv_stream_t *)&conn->client);
+        }
+    }
+    else if (ret != HPE_OK)
+    {
+        httpcb(conn, UV_HTTP_ERROR, (void *)llhttp_errno_name(ret));
+        request_close(conn);
+    }
+}
+
+// 把一小块请求体追加到连接保留的缓冲区, 放不下时换一个新的.
+// 已交给 handler 的数据块仍引用旧缓冲区, 事件循环只写入它们之后的部分.
+// 分配失败时返回 nullptr
+auto body_retain(uv_http_conn_s *conn, const char *data, size_t length)
+    -> ReadBuffer *
+{
+    // 只有连接自己还引用时从头复用, 引用只在事件循环线程上增加
+    if (conn->retained != nullptr &&
+        conn->retained->refs.load(std::memory_order_acquire) == 1)
+    {
+        conn->retainedlen = 0;
+    }
+    if (conn->retained == nullptr ||
+        conn->retained->size - conn->retainedlen < length)
+    {
+        ReadBuffer *buf = ReadBuffer::create(RetainedBufferSize);
+        if (buf == nullptr)
+        {
+            return nullptr;
+        }
+        if (conn->retained != nullptr)
+        {
+            conn->retained->unref();
+        }
+        conn->retained = buf;
+        conn->retainedlen = 0;
+    }
+    std::memcpy(conn->retained->data() + conn->retainedlen, data, length);
+    conn->retainedlen += length;
+    return conn->retained;
+}
+
+// 队列有空位后继续解析暂停前读到的数据
+void request_resume(uv_http_conn_s *conn)
+{
+    conn->paused = false;
+    llhttp_resume(&conn->parser);
+    if (conn->pending != nullptr)
+    {
+        ReadBuffer *buf = conn->pending;
+        conn->pending = nullptr;
+        request_execute(conn, buf, conn->pendingdata, conn->pendinglen);
+        buf->unref();
+    }
+
+    request_read(conn);
+}
+
+// 没有暂停解析, 请求体也没有积压时继续读取
+void request_read(uv_http_conn_s *conn)
+{
+    if (!conn->closed && !conn->paused && !conn->throttled && !conn->eof)
+    {
+        uv_read_start((uv_stream_t *)&conn->client, onalloc, onread);
+    }
+}
+
+// handler 线程读取请求体后积压降到低水位, 在 handler 线程上调用
+void body_drained(void *arg)
+{
+    task_complete(&static_cast<uv_http_conn_s *>(arg)->resume);
+}
+
+// 请求体积压已消化, 恢复读取
+void request_unthrottle(uv_http_conn_s *conn)
+{
+    conn->throttled = false;
+    bool closed = conn->closed;
+    request_release(conn);
+    if (!closed)
+    {
+        request_read(conn);
+    }
 }
 
 auto onmessagebegin(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
+    uv_timer_stop(&conn->timer);
+    conn->parsing = message_acquire(conn);
+    if (conn->http->metrics != nullptr)
+    {
+        conn->parsing->received = uv_hrtime();
+    }
+    conn->mark = 0;
+    conn->trailing = false;
+    return 0;
+}
+
+// 把分段回调的数据追加到请求的 head 中, 同一字段的各段是连续的
+auto onspan(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
+    std::string &head = conn->parsing->head;
+    if (head.size() + length > conn->http->max_header_size)
+    {
+        llhttp_set_error_reason(parser, "Header overflow");
+        return HPE_USER;
+    }
+    head.append(at, length);
     return 0;
 }
 
+// 字段结束, 返回从 mark 开始的完整字段
+auto spancomplete(uv_http_conn_s *conn) -> std::string_view
+{
+    const std::string &head = conn->parsing->head;
+    std::string_view span(head.data() + conn->mark, head.size() - conn->mark);
+    conn->mark = head.size();
+    return span;
+}
+
 auto onurl(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    return onspan(parser, at, length);
+}
+
+auto onurlcomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    conn->request.url = std::string(at, length);
+    conn->parsing->request.url = spancomplete(conn);
     return 0;
 }
 
@@ -188,31 +1436,53 @@ auto onstatus(llhttp_t *parser, const char *at, size_t length) -> int
 }
 
 auto onmethod(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    return onspan(parser, at, length);
+}
+
+auto onmethodcomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    auto x = std::string(at, length);
-    conn->request.method = x;
+    conn->parsing->request.method = spancomplete(conn);
     return 0;
 }
 
 auto onversion(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    return onspan(parser, at, length);
+}
+
+auto onversioncomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    conn->request.version = std::string(at, length);
+    conn->parsing->request.version = spancomplete(conn);
     return 0;
 }
 
 auto onheaderfield(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    return onspan(parser, at, length);
+}
+
+auto onheaderfieldcomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    conn->currentheaderfield = std::string(at, length);
+    conn->currentheaderfield = spancomplete(conn);
     return 0;
 }
 
 auto onheadervalue(llhttp_t *parser, const char *at, size_t length) -> int
+{
+    return onspan(parser, at, length);
+}
+
+auto onheadervaluecomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    conn->request.headers[conn->currentheaderfield] = std::string(at, length);
+    request_s &request = conn->parsing->request;
+    // handler 可能已在读取 headers, trailer 单独存放
+    (conn->trailing ? request.trailers : request.headers)
+        .add(conn->currentheaderfield, spancomplete(conn));
     return 0;
 }
 
@@ -220,38 +1490,118 @@ auto onheaderscomplete(llhttp_t *parser) -> int
 {
     uv_thread_t tid;
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
+    uv_http_message_s *msg = conn->parsing;
+    msg->request.method_id = llhttp_get_method(parser);
+    conn->trailing = true;
 
-    auto contentlength = conn->request.headers.find("Content-Length");
-    if (contentlength != conn->request.headers.end())
+    auto *http = conn->http;
+    conn->requests++;
+    msg->keepalive = http->keepalive_timeout > 0 &&
+                     llhttp_should_keep_alive(parser) &&
+                     (http->max_requests == 0 ||
+                      conn->requests < http->max_requests);
+
+    http->engine->match(msg->request, msg->route);
+    if (http->metrics != nullptr)
     {
-        auto *buf = static_cast<ThreadSafeReaderStreambuf *>(conn->buf);
-        buf->setRemainingSize(std::stoi(contentlength->second));
+        http->metrics->record(Metrics::Parse, msg->route.id,
+                              uv_hrtime() - msg->received);
     }
 
-    uv_queue_work(
-        conn->http->loop, &conn->work,
-        [](uv_work_t *req)
-        {
-            uv_http_conn_s *conn = container_of(req, uv_http_conn_s, work);
-            httpcb(conn, UV_HTTP_MESSAGE, &conn->request);
-        },
-        request_done);
+    conn->refs++;
+    msg->buffered = msg->route.execution == Execution::Inline ||
+                    msg->route.body == BodyMode::Buffered;
+    if (!msg->buffered)
+    {
+        message_dispatch(msg);
+        return 0;
+    }
 
+    // 请求体读完后在 onmessagecomplete 中执行
+    msg->request.body->rdbuf(msg->databuf);
+    if (parser->flags & F_CONTENT_LENGTH)
+    {
+        if (parser->content_length > http->max_body_size)
+        {
+            // 不再解析后续数据, 响应写出后关闭连接
+            message_reject(msg);
+            return HPE_PAUSED;
+        }
+        msg->data.reserve(parser->content_length);
+    }
     return 0;
 }
 
 auto onbody(llhttp_t *parser, const char *at, size_t length) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
-    auto *buf = static_cast<ThreadSafeReaderStreambuf *>(conn->buf);
-    // fmt::println("Body length: {}", length);
-    buf->write(at, length);
+    uv_http_message_s *msg = conn->parsing;
+    if (msg->buffered)
+    {
+        // 已经响应 413 时丢弃后续数据
+        if (msg->done)
+        {
+            return 0;
+        }
+        if (msg->data.size() + length > conn->http->max_body_size)
+        {
+            message_reject(msg);
+            return 0;
+        }
+        msg->data.append(at, length);
+        return 0;
+    }
+
+    // 大块不拷贝, 数据块引用读缓冲区. handler 读得比对端发得慢时暂停读取,
+    // 已读到的这一块仍会解析完, 积压最多超出一个读缓冲区
+    auto *http = conn->http;
+    ReadBuffer *buf = conn->reading;
+    if (length < SmallBodyChunk)
+    {
+        // 对端逐字节发送时每块都引用一个读缓冲区会占住大量内存,
+        // 小块拷贝到保留的缓冲区, 读缓冲区在 onread 结束后回到池中
+        buf = body_retain(conn, at, length);
+        if (buf == nullptr)
+        {
+            return -1;
+        }
+        at = buf->data() + conn->retainedlen - length;
+    }
+    size_t pinned = msg->buf->push(buf, at, length);
+    if (pinned > http->body_high_water && !conn->throttled &&
+        msg->buf->wait(http->body_low_water, body_drained, conn))
+    {
+        conn->throttled = true;
+        conn->refs++;
+        task_hold(http);
+        uv_read_stop((uv_stream_t *)&conn->client);
+    }
     return 0;
 }
 
 auto onmessagecomplete(llhttp_t *parser) -> int
 {
     uv_http_conn_s *conn = container_of(parser, uv_http_conn_s, parser);
+    uv_http_message_s *msg = conn->parsing;
+    msg->complete = true;
+    conn->parsing = nullptr;
+
+    if (!msg->buffered)
+    {
+        msg->buf->finish();
+    }
+    else if (!msg->done)
+    {
+        msg->request.data = msg->data;
+        msg->databuf->reset(msg->data.data(), msg->data.size());
+        message_dispatch(msg);
+    }
+
+    // 连接即将关闭或队列已满时停止向前解析
+    if (!msg->keepalive || conn->queued >= conn->http->max_pipeline)
+    {
+        return HPE_PAUSED;
+    }
     return 0;
 }
 
@@ -271,7 +1621,36 @@ void defaulthttpcb(uv_http_conn_s *conn, uv_http_event_t event, void *data)
     }
     case UV_HTTP_MESSAGE:
     {
-        conn->http->engine->ServeHTTP(conn->request, conn->response);
+        auto *msg = static_cast<uv_http_message_s *>(data);
+        try
+        {
+            conn->http->engine->ServeHTTP(msg->request, msg->response,
+                                          msg->route);
+        }
+        catch (const std::exception &e)
+        {
+            // handler 可能在事件循环线程上执行, 异常不能穿过 llhttp 的回调.
+            // 流式响应已经写出了响应头, 只能关闭连接
+            if (msg->response.isStreaming())
+            {
+                msg->response.fail();
+            }
+            else
+            {
+                msg->response.setStatus(500)->setBody(e.what());
+            }
+        }
+        catch (...)
+        {
+            if (msg->response.isStreaming())
+            {
+                msg->response.fail();
+            }
+            else
+            {
+                msg->response.setStatus(500)->setBody("Internal Server Error");
+            }
+        }
         break;
     }
     default:
@@ -289,14 +1668,123 @@ void httpcb(uv_http_conn_s *conn, uv_http_event_t event, void *data)
 
 void request_close(uv_http_conn_s *conn)
 {
-    uv_close((uv_handle_t *)&conn->client, [](uv_handle_t *handle)
-             {
-        uv_http_conn_s *conn =
-            container_of((uv_tcp_t *)handle, uv_http_conn_s, client);
-        delete static_cast<ThreadSafeReaderStreambuf *>(conn->buf);
-        delete conn->response_str;
-        delete conn->request.body;
-        delete conn; });
+    if (conn->closed)
+    {
+        return;
+    }
+    conn->closed = true;
+
+    // 不会再有请求体到达, 等待读取的 handler 读完已到达的数据后出错
+    for (auto *msg = conn->head; msg != nullptr; msg = msg->next)
+    {
+        msg->buf->abort();
+        msg->writer->close();
+    }
+
+    auto onclose = [](uv_handle_t *handle)
+    { request_release(static_cast<uv_http_conn_s *>(handle->data)); };
+    uv_close((uv_handle_t *)&conn->timer, onclose);
+    uv_close((uv_handle_t *)&conn->client, onclose);
+}
+
+// 句柄全部关闭且没有进行中的 work 时释放连接
+void request_release(uv_http_conn_s *conn)
+{
+    if (--conn->refs > 0)
+    {
+        return;
+    }
+
+    if (conn->prev != nullptr)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        conn->http->conns = conn->next;
+    }
+    if (conn->next != nullptr)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    if (conn->pending != nullptr)
+    {
+        conn->pending->unref();
+        conn->pending = nullptr;
+    }
+    if (conn->retained != nullptr)
+    {
+        conn->retained->unref();
+        conn->retained = nullptr;
+    }
+
+    uv_http_s *http = conn->http;
+    if (http->metrics != nullptr)
+    {
+        http->metrics->closed();
+    }
+    if (http->stopping || http->nfreeconns >= MaxFreeConns)
+    {
+        conn_free(conn);
+        return;
+    }
+    conn_recycle(conn);
+    conn->next = http->freeconns;
+    http->freeconns = conn;
+    http->nfreeconns++;
+}
+
+// 重置已释放的连接, 未完成的请求也放回空闲链表, 由 uv_http_conn_init 重新初始化句柄
+void conn_recycle(uv_http_conn_s *conn)
+{
+    while (conn->head != nullptr)
+    {
+        auto *next = conn->head->next;
+        message_recycle(conn, conn->head);
+        conn->head = next;
+    }
+    conn->tail = nullptr;
+    conn->parsing = nullptr;
+    conn->queued = 0;
+
+    conn->prev = nullptr;
+    conn->next = nullptr;
+    conn->mark = 0;
+    conn->currentheaderfield = {};
+    conn->trailing = false;
+    conn->writing = 0;
+    conn->headbuf.clear();
+    conn->bufs.clear();
+    conn->requests = 0;
+    conn->refs = 0;
+    conn->reading = nullptr;
+    conn->pendingdata = nullptr;
+    conn->pendinglen = 0;
+    conn->retainedlen = 0;
+    conn->paused = false;
+    conn->throttled = false;
+    conn->eof = false;
+    conn->closed = false;
+}
+
+void conn_free(uv_http_conn_s *conn)
+{
+    for (auto *list : {conn->head, conn->spare})
+    {
+        while (list != nullptr)
+        {
+            auto *next = list->next;
+            message_free(list);
+            list = next;
+        }
+    }
+    delete conn;
+}
+
+void ontimeout(uv_timer_t *handle)
+{
+    request_close(static_cast<uv_http_conn_s *>(handle->data));
 }
 
 void write_cb(uv_write_t *req, int status)
@@ -305,6 +1793,82 @@ void write_cb(uv_write_t *req, int status)
     uv_http_conn_s *conn =
         container_of((uv_tcp_t *)stream, uv_http_conn_s, client);
 
-    delete req;
-    request_close(conn);
+    unsigned int written = conn->writing;
+    conn->writing = 0;
+    if (status < 0)
+    {
+        request_close(conn);
+        return;
+    }
+
+    if (conn->http->metrics != nullptr)
+    {
+        size_t bytes = 0;
+        for (const auto &buf : conn->bufs)
+        {
+            bytes += buf.len;
+        }
+        conn->http->metrics->sent(bytes);
+    }
+    request_written(conn, written);
+}
+
+// 队首 written 个响应已写出, 回收已完整写出的请求
+void request_written(uv_http_conn_s *conn, unsigned int written)
+{
+    for (unsigned int i = 0; i < written; i++)
+    {
+        uv_http_message_s *msg = conn->head;
+        if (msg->inflight > 0)
+        {
+            msg->writer->written(msg->inflight);
+            msg->inflight = 0;
+        }
+        // 流式响应还没写完
+        if (!msg->finished)
+        {
+            break;
+        }
+        if (conn->http->metrics != nullptr)
+        {
+            conn->http->metrics->record(Metrics::Write, msg->route.id,
+                                        uv_hrtime() - msg->sent);
+        }
+
+        if (!msg->keepalive)
+        {
+            request_close(conn);
+            return;
+        }
+
+        conn->head = msg->next;
+        if (conn->head == nullptr)
+        {
+            conn->tail = nullptr;
+        }
+        conn->queued--;
+        message_recycle(conn, msg);
+    }
+
+    if (conn->head == nullptr)
+    {
+        if (conn->eof)
+        {
+            request_close(conn);
+            return;
+        }
+        if (conn->http->keepalive_timeout > 0)
+        {
+            uv_timer_start(&conn->timer, ontimeout,
+                           conn->http->keepalive_timeout, 0);
+        }
+    }
+
+    // 最后一个请求要求关闭连接时不再解析后续数据
+    if (conn->paused && conn->queued < conn->http->max_pipeline &&
+        (conn->tail == nullptr || conn->tail->keepalive))
+    {
+        request_resume(conn);
+    }
+    request_flush(conn);
 }
@@ -0,0 +1,332 @@
+#include "metrics.h"
+#include "router.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+
+namespace
+{
+
+constexpr const char *PhaseNames[] = {"parse", "queue", "handler", "serialize",
+                                      "write"};
+constexpr const char *StatusClasses[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+constexpr int StatusClassCount = 5;
+
+// 输出的 le 边界, 纳秒. 每个 le 只计入整个桶都不超过它的样本,
+// 跨过边界的桶计入下一个 le, 计数最多偏少一个桶的宽度
+constexpr struct
+{
+    uint64_t ns;
+    const char *label;
+} Bounds[] = {
+    {1000, "1e-06"},       {5000, "5e-06"},       {10000, "1e-05"},
+    {50000, "5e-05"},      {100000, "0.0001"},    {500000, "0.0005"},
+    {1000000, "0.001"},    {5000000, "0.005"},    {10000000, "0.01"},
+    {50000000, "0.05"},    {100000000, "0.1"},    {500000000, "0.5"},
+    {1000000000, "1"},     {5000000000, "5"},     {10000000000, "10"},
+};
+
+void appendNumber(std::string &out, uint64_t n)
+{
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), n);
+    out.append(buf, res.ptr);
+}
+
+void appendSeconds(std::string &out, uint64_t ns)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%llu.%09llu",
+                       static_cast<unsigned long long>(ns / 1000000000),
+                       static_cast<unsigned long long>(ns % 1000000000));
+    out.append(buf, len);
+}
+
+// 标签值中的反斜杠, 双引号和换行需要转义
+void appendLabel(std::string &out, const char *name, std::string_view value)
+{
+    out.append(name).append("=\"");
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if (c == '\n')
+        {
+            out.append("\\n");
+        }
+        else
+        {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+}
+
+} // namespace
+
+auto Metrics::bucketOf(uint64_t ns) -> int
+{
+    if (ns < LinearCount)
+    {
+        return static_cast<int>(ns);
+    }
+    int exponent = 63;
+    while ((ns >> exponent) == 0)
+    {
+        exponent--;
+    }
+    if (exponent > MaxExponent)
+    {
+        return BucketCount - 1;
+    }
+    int sub = static_cast<int>(ns >> (exponent - SubBits)) &
+              ((1 << SubBits) - 1);
+    return LinearCount + (exponent - SubBits - 1) * (1 << SubBits) + sub;
+}
+
+auto Metrics::bucketLimit(int bucket) -> uint64_t
+{
+    if (bucket < LinearCount)
+    {
+        return bucket + 1;
+    }
+    int k = bucket - LinearCount;
+    int exponent = SubBits + 1 + k / (1 << SubBits);
+    uint64_t sub = k % (1 << SubBits);
+    return ((1ull << SubBits) + sub + 1) << (exponent - SubBits);
+}
+
+Metrics::thread_s::~thread_s()
+{
+    for (size_t i = 0; histograms != nullptr && i < histogramCount; i++)
+    {
+        delete histograms[i].load(std::memory_order_relaxed);
+    }
+}
+
+Metrics::Metrics(Engine *engine)
+{
+    size_t count = engine->routeCount();
+    routes.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string_view method;
+        std::string_view path;
+        engine->routeName(static_cast<int>(i), method, path);
+        routes[i].method = method;
+        routes[i].path = path;
+    }
+    slots = count + 1;
+}
+
+// 当前线程的统计数据, 第一次写入时创建
+auto Metrics::local() -> thread_s *
+{
+    return threads.local(
+        [this](size_t)
+        {
+            auto t = std::make_unique<thread_s>();
+            t->histogramCount = PhaseCount * slots;
+            t->histograms = std::make_unique<std::atomic<histogram_s *>[]>(
+                t->histogramCount);
+            t->statuses = std::make_unique<std::atomic<uint64_t>[]>(
+                slots * StatusClassCount);
+            return t;
+        });
+}
+
+void Metrics::record(Phase phase, int route, uint64_t ns)
+{
+    thread_s *t = local();
+    auto &slot = t->histograms[phase * slots + slotOf(route)];
+    histogram_s *h = slot.load(std::memory_order_relaxed);
+    if (h == nullptr)
+    {
+        h = new histogram_s();
+        // render 在其它线程上读取, 需看到初始化后的内容
+        slot.store(h, std::memory_order_release);
+    }
+    add(h->buckets[bucketOf(ns)], 1);
+    add(h->sum, ns);
+}
+
+void Metrics::status(int route, int code)
+{
+    int cls = code / 100 - 1;
+    if (cls < 0 || cls >= StatusClassCount)
+    {
+        return;
+    }
+    add(local()->statuses[slotOf(route) * StatusClassCount + cls], 1);
+}
+
+void Metrics::received(size_t bytes)
+{
+    add(local()->received, bytes);
+}
+
+void Metrics::sent(size_t bytes)
+{
+    add(local()->sent, bytes);
+}
+
+void Metrics::opened()
+{
+    add(local()->opened, 1);
+}
+
+void Metrics::closed()
+{
+    add(local()->closed, 1);
+}
+
+void Metrics::render(std::string &out)
+{
+    std::vector<thread_s *> snapshot = threads.snapshot();
+
+    // 各路由的名字标签, 最后一个是没有匹配到路由的请求
+    auto labels = [this](std::string &out, size_t slot)
+    {
+        if (slot < routes.size())
+        {
+            appendLabel(out, "method", routes[slot].method);
+            out.push_back(',');
+            appendLabel(out, "route", routes[slot].path);
+        }
+        else
+        {
+            out.append("method=\"\",route=\"unmatched\"");
+        }
+    };
+
+    out.append("# HELP gin_request_duration_seconds Time spent in each phase "
+               "of a request.\n"
+               "# TYPE gin_request_duration_seconds histogram\n");
+    std::vector<uint64_t> buckets(BucketCount);
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        for (size_t slot = 0; slot < slots; slot++)
+        {
+            std::fill(buckets.begin(), buckets.end(), 0);
+            uint64_t sum = 0;
+            bool found = false;
+            for (thread_s *t : snapshot)
+            {
+                histogram_s *h = t->histograms[phase * slots + slot].load(
+                    std::memory_order_acquire);
+                if (h == nullptr)
+                {
+                    continue;
+                }
+                found = true;
+                for (int i = 0; i < BucketCount; i++)
+                {
+                    buckets[i] += h->buckets[i].load(std::memory_order_relaxed);
+                }
+                sum += h->sum.load(std::memory_order_relaxed);
+            }
+            if (!found)
+            {
+                continue;
+            }
+
+            // 总数由各桶相加得到, 和 +Inf 桶保持一致
+            uint64_t cumulative = 0;
+            int bucket = 0;
+            auto series = [&](const char *suffix)
+            {
+                out.append("gin_request_duration_seconds").append(suffix);
+                out.push_back('{');
+                labels(out, slot);
+                out.append(",phase=\"").append(PhaseNames[phase]).append("\"");
+            };
+            for (const auto &bound : Bounds)
+            {
+                while (bucket < BucketCount &&
+                       bucketLimit(bucket) <= bound.ns + 1)
+                {
+                    cumulative += buckets[bucket++];
+                }
+                series("_bucket");
+                out.append(",le=\"").append(bound.label).append("\"} ");
+                appendNumber(out, cumulative);
+                out.push_back('\n');
+            }
+            while (bucket < BucketCount)
+            {
+                cumulative += buckets[bucket++];
+            }
+            series("_bucket");
+            out.append(",le=\"+Inf\"} ");
+            appendNumber(out, cumulative);
+            out.push_back('\n');
+            series("_sum");
+            out.append("} ");
+            appendSeconds(out, sum);
+            out.push_back('\n');
+            series("_count");
+            out.append("} ");
+            appendNumber(out, cumulative);
+            out.push_back('\n');
+        }
+    }
+
+    out.append("# HELP gin_requests_total Responses sent, by status class.\n"
+               "# TYPE gin_requests_total counter\n");
+    for (size_t slot = 0; slot < slots; slot++)
+    {
+        for (int cls = 0; cls < StatusClassCount; cls++)
+        {
+            uint64_t count = 0;
+            for (thread_s *t : snapshot)
+            {
+                count += t->statuses[slot * StatusClassCount + cls].load(
+                    std::memory_order_relaxed);
+            }
+            if (count == 0)
+            {
+                continue;
+            }
+            out.append("gin_requests_total{");
+            labels(out, slot);
+            out.append(",code=\"").append(StatusClasses[cls]).append("\"} ");
+            appendNumber(out, count);
+            out.push_back('\n');
+        }
+    }
+
+    uint64_t received = 0;
+    uint64_t sent = 0;
+    uint64_t opened = 0;
+    uint64_t closed = 0;
+    for (thread_s *t : snapshot)
+    {
+        received += t->received.load(std::memory_order_relaxed);
+        sent += t->sent.load(std::memory_order_relaxed);
+        opened += t->opened.load(std::memory_order_relaxed);
+        closed += t->closed.load(std::memory_order_relaxed);
+    }
+    // 打开和关闭可能在不同时刻读到, 不让活跃数出现负数
+    uint64_t active = opened > closed ? opened - closed : 0;
+
+    out.append("# HELP gin_connections_active Connections currently open.\n"
+               "# TYPE gin_connections_active gauge\n"
+               "gin_connections_active ");
+    appendNumber(out, active);
+    out.append("\n# HELP gin_connections_total Connections accepted.\n"
+               "# TYPE gin_connections_total counter\n"
+               "gin_connections_total ");
+    appendNumber(out, opened);
+    out.append("\n# HELP gin_received_bytes_total Bytes read from clients.\n"
+               "# TYPE gin_received_bytes_total counter\n"
+               "gin_received_bytes_total ");
+    appendNumber(out, received);
+    out.append("\n# HELP gin_sent_bytes_total Bytes written to clients.\n"
+               "# TYPE gin_sent_bytes_total counter\n"
+               "gin_sent_bytes_total ");
+    appendNumber(out, sent);
+    out.push_back('\n');
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "perthread.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Engine;
+
+// 按路由和阶段统计请求耗时, 以及连接数, 收发字节数和各类状态码的请求数.
+// 每个线程写入自己的一份, 只有这个线程修改, 不加锁也不用原子的读改写,
+// render 时把各线程的数据合并
+class Metrics
+{
+public:
+    // 请求的各个阶段
+    enum Phase
+    {
+        Parse,     // 从请求的第一个字节到请求头解析完
+        Queue,     // 在线程池中等待执行
+        Handler,   // 执行 handler
+        Serialize, // 生成状态行和响应头
+        Write,     // 从响应头交给 uv_write 到整个响应写完
+        PhaseCount,
+    };
+
+    // 对数线性分桶 (类似 HdrHistogram): 小于 16 纳秒的每纳秒一个桶,
+    // 之后每个 2 的幂区间分成 8 个桶, 相对误差不超过 12.5%
+    static constexpr int SubBits = 3;
+    static constexpr int LinearCount = 2 << SubBits;
+    // 最大约 2199 秒, 更长的计入最后一个桶
+    static constexpr int MaxExponent = 40;
+    static constexpr int BucketCount =
+        LinearCount + (MaxExponent - SubBits) * (1 << SubBits);
+
+    static auto bucketOf(uint64_t ns) -> int;
+    // 桶的上界 (不含), 纳秒
+    static auto bucketLimit(int bucket) -> uint64_t;
+
+private:
+    struct histogram_s
+    {
+        std::atomic<uint64_t> buckets[BucketCount];
+        // 纳秒之和
+        std::atomic<uint64_t> sum;
+    };
+
+    struct thread_s
+    {
+        // 按 [phase][slot] 存放, 第一次写入时分配
+        std::unique_ptr<std::atomic<histogram_s *>[]> histograms;
+        size_t histogramCount = 0;
+        // 按 [slot][状态码类别] 存放
+        std::unique_ptr<std::atomic<uint64_t>[]> statuses;
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> opened{0};
+        std::atomic<uint64_t> closed{0};
+
+        ~thread_s();
+    };
+
+    struct route_s
+    {
+        std::string method;
+        std::string path;
+    };
+
+    // 各路由的名字, 最后一个 slot 是没有匹配到路由的请求
+    std::vector<route_s> routes;
+    size_t slots;
+
+    PerThread<thread_s> threads;
+
+    auto local() -> thread_s *;
+    auto slotOf(int route) const -> size_t
+    {
+        return route >= 0 && static_cast<size_t>(route) < routes.size()
+                   ? route
+                   : routes.size();
+    }
+
+    // 只由所属线程调用
+    static void add(std::atomic<uint64_t> &counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+public:
+    // 路由编号和名字取自 engine, 需在 freeze 之后创建
+    explicit Metrics(Engine *engine);
+
+    // 以下在任意线程上调用, route 是 Route::id
+    void record(Phase phase, int route, uint64_t ns);
+    void status(int route, int code);
+    void received(size_t bytes);
+    void sent(size_t bytes);
+    void opened();
+    void closed();
+
+    // 合并各线程的数据, 以 Prometheus 文本格式追加到 out
+    void render(std::string &out);
+};
@@ -0,0 +1,260 @@
+#include "middleware/accesslog.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+namespace
+{
+
+auto micros(std::chrono::steady_clock::time_point t) -> int64_t
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               t.time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+AccessLog::AccessLog(size_t capacity, unsigned int interval)
+    : capacity(ringCapacity(capacity)), interval(std::max(interval, 1u))
+{
+    auto system = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    epoch = system - micros(std::chrono::steady_clock::now());
+    uv_loop_init(&loop);
+}
+
+AccessLog::~AccessLog()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (drainer.joinable())
+    {
+        drainer.join();
+    }
+
+    if (file >= 0)
+    {
+        uv_fs_t req;
+        uv_fs_close(&loop, &req, file, nullptr);
+        uv_fs_req_cleanup(&req);
+    }
+    uv_loop_close(&loop);
+}
+
+auto AccessLog::openFile(const char *path) -> int
+{
+    uv_fs_t req;
+    int fd = uv_fs_open(&loop, &req, path,
+                        UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_APPEND, 0644,
+                        nullptr);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    file = fd;
+    return 0;
+}
+
+void AccessLog::setSink(logsink sink, void *arg)
+{
+    this->sink = sink;
+    this->arg = arg;
+}
+
+void AccessLog::start()
+{
+    drainer = std::thread([this]() { run(); });
+}
+
+// 当前线程的环形缓冲区, 第一次写入时创建
+auto AccessLog::ring() -> ring_s *
+{
+    return rings.local(
+        [this](size_t)
+        {
+            auto r = std::make_unique<ring_s>();
+            r->records = std::make_unique<access_record_s[]>(capacity);
+            r->mask = capacity - 1;
+            return r;
+        });
+}
+
+void AccessLog::append(std::string_view method, std::string_view uri,
+                       int status, std::chrono::steady_clock::time_point end,
+                       std::chrono::microseconds duration)
+{
+    ring_s *r = ring();
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) > r->mask)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    access_record_s &record = r->records[head & r->mask];
+    record.time = micros(end) + epoch;
+    record.duration = duration.count();
+    record.status = status;
+    record.methodlen = static_cast<uint16_t>(
+        std::min(method.size(), sizeof(record.method)));
+    record.urilen =
+        static_cast<uint16_t>(std::min(uri.size(), sizeof(record.uri)));
+    std::memcpy(record.method, method.data(), record.methodlen);
+    std::memcpy(record.uri, uri.data(), record.urilen);
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+void AccessLog::run()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping)
+    {
+        cv.wait_for(lock, interval, [this]() { return stopping; });
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+    lock.unlock();
+
+    // 停止前写入的记录也要取出
+    while (drain())
+    {
+    }
+}
+
+auto AccessLog::drain() -> bool
+{
+    std::vector<ring_s *> snapshot = rings.snapshot();
+
+    bool any = false;
+    for (ring_s *r : snapshot)
+    {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        while (tail < head)
+        {
+            // 一次取出环形缓冲区中连续的一段
+            size_t start = tail & r->mask;
+            size_t count = std::min<uint64_t>(head - tail, capacity - start);
+            if (sink != nullptr)
+            {
+                sink(&r->records[start], count, arg);
+            }
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    format(r->records[start + i]);
+                }
+            }
+            tail += count;
+            r->tail.store(tail, std::memory_order_release);
+            any = true;
+        }
+    }
+
+    if (sink == nullptr)
+    {
+        uint64_t lost = dropped.load(std::memory_order_relaxed);
+        if (lost != reported)
+        {
+            char line[96];
+            int len = snprintf(line, sizeof(line),
+                               "[GIN] access log dropped %llu records\n",
+                               static_cast<unsigned long long>(lost - reported));
+            batch.append(line, len);
+            reported = lost;
+        }
+        flush();
+    }
+    return any;
+}
+
+void AccessLog::format(const access_record_s &record)
+{
+    time_t seconds = static_cast<time_t>(record.time / 1000000);
+    struct tm tm;
+#ifdef _WIN32
+    localtime_s(&tm, &seconds);
+#else
+    localtime_r(&seconds, &tm);
+#endif
+
+    char line[128];
+    int len = snprintf(line, sizeof(line),
+                       "[GIN] %04d/%02d/%02d - %02d:%02d:%02d | %3d | %10lldus | ",
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                       tm.tm_min, tm.tm_sec, record.status,
+                       static_cast<long long>(record.duration));
+    batch.append(line, len);
+    batch.append(record.method, record.methodlen);
+    batch.append(1, ' ');
+    batch.append(record.uri, record.urilen);
+    batch.append(1, '\n');
+}
+
+// 一次系统调用写出整批日志
+void AccessLog::flush()
+{
+    size_t offset = 0;
+    while (file >= 0 && offset < batch.size())
+    {
+        uv_fs_t req;
+        uv_buf_t buf = uv_buf_init(&batch[offset],
+                                   static_cast<unsigned int>(batch.size() - offset));
+        int n = uv_fs_write(&loop, &req, file, &buf, 1, -1, nullptr);
+        uv_fs_req_cleanup(&req);
+        if (n <= 0)
+        {
+            break;
+        }
+        offset += n;
+    }
+    batch.clear();
+}
+
+auto access_log_open(AccessLog **log, const char *path, size_t capacity,
+                     unsigned int interval) -> int
+{
+    auto *access = new AccessLog(capacity, interval);
+    int err = access->openFile(path);
+    if (err)
+    {
+        delete access;
+        return err;
+    }
+    access->start();
+    *log = access;
+    return 0;
+}
+
+auto access_log_sink(AccessLog **log, logsink sink, void *arg, size_t capacity,
+                     unsigned int interval) -> int
+{
+    if (sink == nullptr)
+    {
+        return UV_EINVAL;
+    }
+    auto *access = new AccessLog(capacity, interval);
+    access->setSink(sink, arg);
+    access->start();
+    *log = access;
+    return 0;
+}
+
+auto access_log_dropped(AccessLog *log) -> uint64_t
+{
+    return log->droppedCount();
+}
+
+void access_log_close(AccessLog *log)
+{
+    delete log;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "middleware/logger.h"
+#include "perthread.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <uv.h>
+#include <vector>
+
+class AccessLog
+{
+private:
+    // 单个请求线程写入, 后台线程读取的环形缓冲区
+    struct ring_s
+    {
+        std::unique_ptr<access_record_s[]> records;
+        size_t mask;
+        // 只由写入线程修改
+        alignas(64) std::atomic<uint64_t> head{0};
+        // 只由后台线程修改
+        alignas(64) std::atomic<uint64_t> tail{0};
+    };
+
+    size_t capacity;
+    std::chrono::milliseconds interval;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    PerThread<ring_s> rings;
+    bool stopping = false;
+    std::thread drainer;
+
+    std::atomic<uint64_t> dropped{0};
+    // 已经写进日志文件的丢弃数
+    uint64_t reported = 0;
+
+    // 写入文件时使用, 同步的 uv_fs 调用只用到 loop 的字段
+    uv_loop_t loop;
+    uv_file file = -1;
+    std::string batch;
+
+    logsink sink = nullptr;
+    void *arg = nullptr;
+
+    // 以 steady_clock 计时, 输出时换算为系统时间
+    int64_t epoch;
+
+    auto ring() -> ring_s *;
+    void run();
+    // 取出所有环形缓冲区中的记录, 返回是否取到了记录
+    auto drain() -> bool;
+    void format(const access_record_s &record);
+    void flush();
+
+public:
+    AccessLog(size_t capacity, unsigned int interval);
+    ~AccessLog();
+
+    auto openFile(const char *path) -> int;
+    void setSink(logsink sink, void *arg);
+    void start();
+
+    // 在请求线程上调用, end 是 steady_clock 的时间
+    void append(std::string_view method, std::string_view uri, int status,
+                std::chrono::steady_clock::time_point end,
+                std::chrono::microseconds duration);
+    auto droppedCount() const -> uint64_t
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+};
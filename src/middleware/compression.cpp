@@ -0,0 +1,535 @@
+#include "middleware/compression.h"
+#include "router.h"
+#include <climits>
+#include <zlib.h>
+
+namespace
+{
+
+enum class Encoding
+{
+    None,
+    Gzip,
+    Deflate,
+};
+
+// 流式压缩时每次交给输出端的最大数据量
+constexpr size_t ChunkSize = 16 * 1024;
+// 整体压缩的输出缓冲区超过这个大小时用完就释放, 不长期占用内存
+constexpr size_t RetainSize = 1024 * 1024;
+
+// 每个线程的 zlib 流, 第一次使用时初始化, 之后每个响应只 deflateReset.
+// 一个 zlib 流约占 256KB, gzip 和 deflate 各一个
+struct deflater_s
+{
+    z_stream streams[2];
+    bool ready[2] = {false, false};
+    int levels[2] = {0, 0};
+    // 流式响应在 handler 返回之前一直占用
+    bool busy = false;
+    // 整体压缩的输出
+    std::string out;
+
+    ~deflater_s()
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (ready[i])
+            {
+                deflateEnd(&streams[i]);
+            }
+        }
+    }
+
+    // 取得重置过的流, 已被占用或初始化失败时返回 nullptr
+    auto acquire(Encoding encoding, int level) -> z_stream *
+    {
+        if (busy)
+        {
+            return nullptr;
+        }
+        int i = encoding == Encoding::Gzip ? 0 : 1;
+        z_stream &z = streams[i];
+        if (!ready[i])
+        {
+            z = {};
+            // windowBits 加 16 输出 gzip 格式, 否则是 zlib 格式 (HTTP 的 deflate)
+            int bits = encoding == Encoding::Gzip ? MAX_WBITS + 16 : MAX_WBITS;
+            if (deflateInit2(&z, level, Z_DEFLATED, bits, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                return nullptr;
+            }
+            ready[i] = true;
+            levels[i] = level;
+        }
+        else
+        {
+            deflateReset(&z);
+            // 还没有输入, 修改级别不会产生输出
+            if (levels[i] != level)
+            {
+                if (deflateParams(&z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                {
+                    return nullptr;
+                }
+                levels[i] = level;
+            }
+        }
+        busy = true;
+        return &z;
+    }
+
+    void release() { busy = false; }
+};
+
+thread_local deflater_s deflater;
+
+auto trim(std::string_view s) -> std::string_view
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+    {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+auto startsWith(std::string_view s, std::string_view prefix) -> bool
+{
+    return s.size() >= prefix.size() &&
+           CaseInsensitiveEqual()(s.substr(0, prefix.size()), prefix);
+}
+
+// q 值换算成千分之几, 没有 q 参数时为 1000
+auto quality(std::string_view params) -> int
+{
+    while (!params.empty())
+    {
+        size_t semi = params.find(';');
+        std::string_view param = trim(params.substr(0, semi));
+        params = semi == std::string_view::npos ? std::string_view()
+                                                : params.substr(semi + 1);
+        if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') ||
+            param[1] != '=')
+        {
+            continue;
+        }
+
+        param.remove_prefix(2);
+        int q = 0;
+        if (!param.empty() && param[0] == '1')
+        {
+            return 1000;
+        }
+        if (param.size() > 2 && param[0] == '0' && param[1] == '.')
+        {
+            int scale = 100;
+            for (size_t i = 2; i < param.size() && i < 5; i++)
+            {
+                if (param[i] < '0' || param[i] > '9')
+                {
+                    break;
+                }
+                q += (param[i] - '0') * scale;
+                scale /= 10;
+            }
+        }
+        return q;
+    }
+    return 1000;
+}
+
+// 按 Accept-Encoding 的 q 值选择, 相同时优先 gzip. "*" 匹配没有单独列出的编码
+auto negotiate(std::string_view accept) -> Encoding
+{
+    int gzip = -1;
+    int deflate = -1;
+    int any = -1;
+    while (!accept.empty())
+    {
+        size_t comma = accept.find(',');
+        std::string_view item = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view()
+                                                 : accept.substr(comma + 1);
+
+        size_t semi = item.find(';');
+        std::string_view name = trim(item.substr(0, semi));
+        int q = semi == std::string_view::npos ? 1000
+                                               : quality(item.substr(semi + 1));
+        if (CaseInsensitiveEqual()(name, "gzip") ||
+            CaseInsensitiveEqual()(name, "x-gzip"))
+        {
+            gzip = q;
+        }
+        else if (CaseInsensitiveEqual()(name, "deflate"))
+        {
+            deflate = q;
+        }
+        else if (name == "*")
+        {
+            any = q;
+        }
+    }
+    if (gzip < 0)
+    {
+        gzip = any;
+    }
+    if (deflate < 0)
+    {
+        deflate = any;
+    }
+
+    if (gzip > 0 && gzip >= deflate)
+    {
+        return Encoding::Gzip;
+    }
+    if (deflate > 0)
+    {
+        return Encoding::Deflate;
+    }
+    return Encoding::None;
+}
+
+// 本身已经压缩过的格式, 再压缩只浪费 CPU
+auto compressible(std::string_view type) -> bool
+{
+    type = trim(type.substr(0, type.find(';')));
+    if (startsWith(type, "image/"))
+    {
+        return CaseInsensitiveEqual()(type, "image/svg+xml");
+    }
+    if (startsWith(type, "video/") || startsWith(type, "audio/"))
+    {
+        return false;
+    }
+
+    static constexpr std::string_view compressed[] = {
+        "application/zip",
+        "application/gzip",
+        "application/x-gzip",
+        "application/x-bzip2",
+        "application/x-xz",
+        "application/zstd",
+        "application/x-7z-compressed",
+        "application/x-rar-compressed",
+        "font/woff",
+        "font/woff2",
+    };
+    for (std::string_view name : compressed)
+    {
+        if (CaseInsensitiveEqual()(type, name))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 与正文大小无关的条件: 请求方法、状态码和已有的响应头
+auto eligible(request_s *req, response_s *res) -> bool
+{
+    int status = res->getStatus();
+    if (status < 200 || status == 204 || status == 206 || status == 304 ||
+        req->method == "HEAD")
+    {
+        return false;
+    }
+    std::string value;
+    if (res->getHeader("Content-Encoding", value))
+    {
+        return false;
+    }
+    return !res->getHeader("Content-Type", value) || compressible(value);
+}
+
+// 同一 URL 的响应随 Accept-Encoding 变化, 告诉缓存分开保存
+void addVary(response_s *res)
+{
+    std::string vary;
+    if (!res->getHeader("Vary", vary))
+    {
+        res->addHeader("Vary", "Accept-Encoding");
+        return;
+    }
+
+    std::string_view rest = vary;
+    while (!rest.empty())
+    {
+        size_t comma = rest.find(',');
+        std::string_view name = trim(rest.substr(0, comma));
+        if (name == "*" || CaseInsensitiveEqual()(name, "Accept-Encoding"))
+        {
+            return;
+        }
+        rest = comma == std::string_view::npos ? std::string_view()
+                                               : rest.substr(comma + 1);
+    }
+    res->addHeader("Vary", vary + ", Accept-Encoding");
+}
+
+void markEncoded(response_s *res, Encoding encoding)
+{
+    res->addHeader("Content-Encoding",
+                   encoding == Encoding::Gzip ? "gzip" : "deflate");
+    // 内容已经不是原来的字节, 强 ETag 降为弱 ETag
+    std::string etag;
+    if (res->getHeader("ETag", etag) && etag.compare(0, 2, "W/") != 0)
+    {
+        res->addHeader("ETag", "W/" + etag);
+    }
+}
+
+// 一次压缩整个正文, 没有变小时保留原样
+void compressBody(response_s *res, Encoding encoding, int level)
+{
+    std::string_view body = res->getBody();
+    if (body.size() > UINT_MAX)
+    {
+        return;
+    }
+    z_stream *z = deflater.acquire(encoding, level);
+    if (z == nullptr)
+    {
+        return;
+    }
+
+    std::string &out = deflater.out;
+    out.resize(deflateBound(z, body.size()));
+    z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    z->avail_in = static_cast<uInt>(body.size());
+    z->next_out = reinterpret_cast<Bytef *>(&out[0]);
+    z->avail_out = static_cast<uInt>(out.size());
+    int err = deflate(z, Z_FINISH);
+    deflater.release();
+
+    if (err == Z_STREAM_END && z->total_out < body.size())
+    {
+        out.resize(z->total_out);
+        markEncoded(res, encoding);
+        res->setBody(std::string_view(out));
+    }
+    if (out.capacity() > RetainSize)
+    {
+        std::string().swap(out);
+    }
+}
+
+// 非流式的响应, handler 返回之后整体处理
+void compressResponse(request_s *req, response_s *res, Encoding encoding,
+                      int level, size_t threshold)
+{
+    if (res->getBody().size() < threshold || !eligible(req, res))
+    {
+        return;
+    }
+    addVary(res);
+    if (encoding != Encoding::None)
+    {
+        compressBody(res, encoding, level);
+    }
+}
+
+// 包装服务器的输出端. 先积攒数据, 到 threshold 或第一次 flush 时决定
+// 是否压缩并发出响应头, 之后边写边压缩
+class CompressedStream : public response_stream_s
+{
+private:
+    enum class State
+    {
+        // 还没有决定, 数据积攒在 pending 中
+        Pending,
+        Plain,
+        Deflating,
+        Ended,
+    };
+
+    request_s *req;
+    response_s *res;
+    response_stream_s *inner;
+    Encoding encoding;
+    int level;
+    size_t threshold;
+    State state = State::Pending;
+    std::string pending;
+    z_stream *z = nullptr;
+
+    // 决定是否压缩, 开始流式响应并写出积攒的数据
+    auto decide() -> bool
+    {
+        state = State::Plain;
+        if (eligible(req, res))
+        {
+            addVary(res);
+            if (encoding != Encoding::None &&
+                (z = deflater.acquire(encoding, level)) != nullptr)
+            {
+                markEncoded(res, encoding);
+                state = State::Deflating;
+            }
+        }
+
+        // 空写入也会发出响应头, 之后不能再修改
+        if (!inner->write(nullptr, 0))
+        {
+            return false;
+        }
+        bool ok = pending.empty() || send(pending.data(), pending.size(),
+                                          Z_NO_FLUSH);
+        pending.clear();
+        return ok;
+    }
+
+    auto send(const char *data, size_t size, int flush) -> bool
+    {
+        if (state == State::Plain)
+        {
+            return inner->write(data, size);
+        }
+
+        char buf[ChunkSize];
+        z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        z->avail_in = static_cast<uInt>(size);
+        do
+        {
+            z->next_out = reinterpret_cast<Bytef *>(buf);
+            z->avail_out = sizeof(buf);
+            if (deflate(z, flush) == Z_STREAM_ERROR)
+            {
+                return false;
+            }
+            size_t n = sizeof(buf) - z->avail_out;
+            if (n > 0 && !inner->write(buf, n))
+            {
+                return false;
+            }
+        } while (z->avail_out == 0);
+        return true;
+    }
+
+    void release()
+    {
+        if (z != nullptr)
+        {
+            deflater.release();
+            z = nullptr;
+        }
+    }
+
+public:
+    CompressedStream(request_s *req, response_s *res, response_stream_s *inner,
+                     Encoding encoding, int level, size_t threshold)
+        : req(req), res(res), inner(inner), encoding(encoding), level(level),
+          threshold(threshold)
+    {
+    }
+
+    ~CompressedStream() override { release(); }
+
+    auto write(const char *data, size_t size) -> bool override
+    {
+        switch (state)
+        {
+        case State::Pending:
+            pending.append(data, size);
+            return pending.size() < threshold || decide();
+        case State::Plain:
+        case State::Deflating:
+            return size == 0 || send(data, size, Z_NO_FLUSH);
+        default:
+            return false;
+        }
+    }
+
+    auto flush() -> bool override
+    {
+        if (state == State::Pending && !decide())
+        {
+            return false;
+        }
+        if (state == State::Deflating && !send(nullptr, 0, Z_SYNC_FLUSH))
+        {
+            return false;
+        }
+        return state != State::Ended && inner->flush();
+    }
+
+    void end() override
+    {
+        if (state == State::Pending)
+        {
+            // 在决定之前结束, 正文已经完整, 交回给 compressResponse 整体处理.
+            // recover 已经设置了错误响应时不覆盖
+            if (!pending.empty() && res->getBody().empty())
+            {
+                res->setBody(std::move(pending));
+            }
+        }
+        else if (state != State::Ended)
+        {
+            if (state == State::Deflating)
+            {
+                send(nullptr, 0, Z_FINISH);
+                release();
+            }
+            inner->end();
+        }
+        state = State::Ended;
+    }
+
+    void fail() override
+    {
+        release();
+        state = State::Ended;
+        inner->fail();
+    }
+
+    auto isStarted() -> bool override { return inner->isStarted(); }
+
+    // handler 返回后调用, 结束流式响应. 返回 false 表示没有开始流式响应,
+    // 需要按整体处理
+    auto finish() -> bool
+    {
+        bool streamed = state == State::Plain || state == State::Deflating ||
+                        inner->isStarted();
+        end();
+        return streamed;
+    }
+};
+
+} // namespace
+
+void compression::operator()(Context *ctx)
+{
+    request_s *req = ctx->getRequest();
+    response_s *res = ctx->getResponse();
+    Encoding encoding = negotiate(req->headers.get("Accept-Encoding"));
+
+    // Execution::Inline 的路由没有输出端, write 的数据也在 body 中
+    response_stream_s *inner = res->getStream();
+    if (inner == nullptr)
+    {
+        ctx->next();
+        compressResponse(req, res, encoding, level, threshold);
+        return;
+    }
+
+    CompressedStream stream(req, res, inner, encoding, level, threshold);
+    res->setStream(&stream);
+    // handler 抛出异常时也要换回服务器的输出端
+    struct restore_s
+    {
+        response_s *res;
+        response_stream_s *inner;
+        ~restore_s() { res->setStream(inner); }
+    } restore{res, inner};
+
+    ctx->next();
+    if (!stream.finish())
+    {
+        compressResponse(req, res, encoding, level, threshold);
+    }
+}
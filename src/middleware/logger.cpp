@@ -1,4 +1,5 @@
 #include "middleware/logger.h"
+#include "middleware/accesslog.h"
 #include "router.h"
 #include <chrono>
 #include <functional>
@@ -6,17 +7,30 @@
 void logger::operator()(Context *ctx)
 {
     // 记录开始时间
-    auto start = std::chrono::high_resolution_clock::now();
+    auto start = std::chrono::steady_clock::now();
 
     ctx->next();
 
     // 记录结束时间
-    auto end = std::chrono::high_resolution_clock::now();
+    auto end = std::chrono::steady_clock::now();
 
-    // 计算时差（以毫秒为单位）
+    // 计算时差（以微秒为单位）
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
 
+    // 异步模式只写入当前线程的环形缓冲区, 时间由后台线程换算
+    if (access != nullptr)
+    {
+        access->append(ctx->getRequest()->method, ctx->getRequest()->url,
+                       ctx->getResponse()->getStatus(), end, duration);
+        return;
+    }
+
     auto now = std::chrono::system_clock::now();
 
-    log(now, ctx->getRequest()->method, ctx->getRequest()->url, ctx->getResponse()->getStatus(), duration);
-}
\ No newline at end of file
+    if (logview != nullptr)
+    {
+        logview(now, ctx->getRequest()->method, ctx->getRequest()->url, ctx->getResponse()->getStatus(), duration);
+        return;
+    }
+    log(now, std::string(ctx->getRequest()->method), std::string(ctx->getRequest()->url), ctx->getResponse()->getStatus(), duration);
+}
@@ -3,6 +3,12 @@
 
 void updateResponse(response_s *res, int status, const std::string &body)
 {
+    // 流式响应已经写出了响应头, 只能让连接在响应结束前关闭
+    if (res->isStreaming())
+    {
+        res->fail();
+        return;
+    }
     res->setStatus(status);
     res->setBody(body);
 }
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 每个线程一份 T, 线程第一次访问时创建, 之后只由这个线程写入.
+// 其它线程通过 snapshot 读取所有线程的那一份, 登记后直到 PerThread 析构都不释放
+template <typename T>
+class PerThread
+{
+private:
+    struct entry_s
+    {
+        std::thread::id owner;
+        std::unique_ptr<T> value;
+    };
+
+    // 区分不同的 PerThread<T>, 线程缓存按它查找
+    static inline std::atomic<uint64_t> nextid{1};
+    // 每个线程缓存最近使用的一份, 同一种 T 一般只有一个 PerThread
+    static inline thread_local uint64_t cachedid = 0;
+    static inline thread_local T *cached = nullptr;
+
+    uint64_t id;
+    std::mutex mtx;
+    std::vector<entry_s> entries;
+
+public:
+    PerThread() : id(nextid.fetch_add(1, std::memory_order_relaxed)) {}
+    PerThread(const PerThread &) = delete;
+    auto operator=(const PerThread &) -> PerThread & = delete;
+
+    // 当前线程的一份, 没有时以登记的顺序 (从 0 开始) 调用 create 创建.
+    // create 返回 std::unique_ptr<T>, 在锁内调用
+    template <typename Create>
+    auto local(Create &&create) -> T *
+    {
+        if (cachedid == id)
+        {
+            return cached;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        auto self = std::this_thread::get_id();
+        T *found = nullptr;
+        for (auto &e : entries)
+        {
+            if (e.owner == self)
+            {
+                found = e.value.get();
+                break;
+            }
+        }
+        if (found == nullptr)
+        {
+            entry_s e{self, create(entries.size())};
+            found = e.value.get();
+            entries.push_back(std::move(e));
+        }
+
+        cachedid = id;
+        cached = found;
+        return found;
+    }
+
+    // 目前已登记的各线程的那一份
+    auto snapshot() -> std::vector<T *>
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        std::vector<T *> out;
+        out.reserve(entries.size());
+        for (auto &e : entries)
+        {
+            out.push_back(e.value.get());
+        }
+        return out;
+    }
+};
+
+// 每线程环形缓冲区的容量, 取到 2 的幂 (至少 2), 下标用掩码计算
+inline auto ringCapacity(size_t requested) -> size_t
+{
+    size_t capacity = 2;
+    while (capacity < requested)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
@@ -1,99 +1,335 @@
 #include "reader.h"
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
-#include <iostream>
+#include <new>
+#include <stdexcept>
 
-// 更新缓冲区指针
-void ReaderStreambuf::updatePointers()
+auto ReadBuffer::create(size_t size, ReadBufferPool *pool) -> ReadBuffer *
 {
-    if (data_size > 0)
+    void *p = malloc(sizeof(ReadBuffer) + size);
+    if (p == nullptr)
     {
-        setg(buffer.data(), buffer.data() + tail, buffer.data() + head);
+        return nullptr;
     }
-    else
+    auto *buf = new (p) ReadBuffer();
+    buf->refs.store(1, std::memory_order_relaxed);
+    buf->size = size;
+    buf->pool = pool;
+    buf->next = nullptr;
+    return buf;
+}
+
+auto ReadBuffer::of(char *data) -> ReadBuffer *
+{
+    return reinterpret_cast<ReadBuffer *>(data) - 1;
+}
+
+void ReadBuffer::unref()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
     {
-        setg(buffer.data(), buffer.data(), buffer.data());
+        if (pool != nullptr)
+        {
+            pool->release(this);
+            return;
+        }
+        this->~ReadBuffer();
+        free(this);
     }
 }
 
-// 从缓冲区中获取字符
-auto ReaderStreambuf::underflow() -> int
+auto ReadBufferPool::acquire() -> ReadBuffer *
 {
-    if (data_size == 0)
+    ReadBuffer *buf = nullptr;
+    bool pooled = false;
     {
-        return traits_type::eof();
+        std::unique_lock<std::mutex> lock(mtx);
+        if (idle != nullptr)
+        {
+            buf = idle;
+            idle = buf->next;
+            count--;
+        }
+        else if (!closed)
+        {
+            // 先登记, 避免 close 之后最后一个归还时提前删除池
+            allocated++;
+            pooled = true;
+        }
     }
 
-    // 从缓冲区读取一个字符
-    char current_char = buffer[tail];
-    tail = (tail + 1) % capacity;
-    --data_size;
-
-    // 更新指针
-    setg(buffer.data(), buffer.data() + tail - 1, buffer.data() + tail);
+    if (buf != nullptr)
+    {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        buf->next = nullptr;
+        buf->refs.store(1, std::memory_order_relaxed);
+        return buf;
+    }
 
-    return traits_type::to_int_type(current_char);
+    misses.fetch_add(1, std::memory_order_relaxed);
+    buf = ReadBuffer::create(bufsize, pooled ? this : nullptr);
+    if (buf == nullptr && pooled)
+    {
+        release(nullptr);
+    }
+    return buf;
 }
 
-// 向缓冲区写入数据
-void ReaderStreambuf::write(const char *data, size_t length)
+// buf 为 nullptr 时只撤销 acquire 中的登记
+void ReadBufferPool::release(ReadBuffer *buf)
 {
-    if (length > capacity - data_size)
+    bool remove = false;
     {
-        throw std::overflow_error("Buffer overflow: not enough space");
+        std::unique_lock<std::mutex> lock(mtx);
+        if (buf != nullptr && !closed && count < capacity &&
+            buf->size == bufsize)
+        {
+            buf->next = idle;
+            idle = buf;
+            count++;
+            return;
+        }
+        allocated--;
+        remove = closed && allocated == 0;
     }
 
-    size_t first_chunk = std::min(length, capacity - head);
-    std::memcpy(buffer.data() + head, data, first_chunk);
-    std::memcpy(buffer.data(), data + first_chunk, length - first_chunk);
+    if (buf != nullptr)
+    {
+        buf->~ReadBuffer();
+        free(buf);
+    }
+    if (remove)
+    {
+        delete this;
+    }
+}
 
-    head = (head + length) % capacity;
-    data_size += length;
+// 释放空闲链表, 调用方持有锁
+void ReadBufferPool::drain()
+{
+    while (idle != nullptr)
+    {
+        ReadBuffer *buf = idle;
+        idle = buf->next;
+        buf->~ReadBuffer();
+        free(buf);
+        allocated--;
+    }
+    count = 0;
 }
 
-// 设置剩余数据量
-void ThreadSafeReaderStreambuf::setRemainingSize(size_t remaining_size)
+void ReadBufferPool::configure(size_t bufsize, size_t capacity)
 {
     std::unique_lock<std::mutex> lock(mtx);
-    this->remaining_size = remaining_size;
-    cv.notify_all();
+    drain();
+    this->bufsize = bufsize;
+    this->capacity = capacity;
 }
 
-// 线程安全的 underflow 实现
-auto ThreadSafeReaderStreambuf::underflow() -> int
+void ReadBufferPool::close()
+{
+    bool remove = false;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        drain();
+        closed = true;
+        remove = allocated == 0;
+    }
+    if (remove)
+    {
+        delete this;
+    }
+}
+
+auto ReadBufferPool::cached() -> size_t
 {
     std::unique_lock<std::mutex> lock(mtx);
+    return count;
+}
 
-    // 等待直到缓冲区有数据或者剩余数据为 0
-    cv.wait(lock, [this]() { return available() > 0 || remaining_size == 0; });
+BodyStreambuf::~BodyStreambuf()
+{
+    release();
+}
 
-    // 如果没有剩余数据，返回 EOF
-    if (remaining_size == 0)
+// 释放所有数据块, 调用方持有锁或独占访问
+void BodyStreambuf::release()
+{
+    for (auto &chunk : chunks)
     {
-        return traits_type::eof();
+        chunk.buf->unref();
     }
+    chunks.clear();
+    queued = 0;
+    pinned = 0;
+    if (current != nullptr)
+    {
+        current->unref();
+        current = nullptr;
+    }
+    setg(nullptr, nullptr, nullptr);
+}
 
-    // 调用基础类的 underflow 方法
-    int result = ReaderStreambuf::underflow();
-    if (result != traits_type::eof())
+// 当前块读完后换到下一块, 没有数据时等待事件循环追加
+auto BodyStreambuf::underflow() -> int_type
+{
+    if (gptr() < egptr())
     {
-        --remaining_size;
+        return traits_type::to_int_type(*gptr());
     }
 
-    cv.notify_all();
-    return result;
+    void (*cb)(void *) = nullptr;
+    void *cbarg = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (current != nullptr)
+        {
+            current->unref();
+            current = nullptr;
+        }
+
+        cv.wait(lock, [this]() { return !chunks.empty() || finished; });
+        if (chunks.empty())
+        {
+            setg(nullptr, nullptr, nullptr);
+            if (truncated)
+            {
+                throw std::runtime_error("Request body truncated");
+            }
+            return traits_type::eof();
+        }
+
+        chunk_s chunk = chunks.front();
+        chunks.pop_front();
+        queued -= chunk.size;
+        pinned -= chunk.cost;
+        current = chunk.buf;
+        char *data = const_cast<char *>(chunk.data);
+        setg(data, data, data + chunk.size);
+
+        if (drained != nullptr && pinned <= lowwater)
+        {
+            cb = drained;
+            cbarg = arg;
+            drained = nullptr;
+        }
+    }
+
+    // 在锁外通知, 回调可能要获取事件循环的锁
+    if (cb != nullptr)
+    {
+        cb(cbarg);
+    }
+    return traits_type::to_int_type(*gptr());
 }
 
-// 线程安全的 write 实现
-void ThreadSafeReaderStreambuf::write(const char *data, size_t length)
+// 整块拷贝, 不逐字节经过 uflow
+auto BodyStreambuf::xsgetn(char *s, std::streamsize n) -> std::streamsize
+{
+    std::streamsize got = 0;
+    while (got < n)
+    {
+        std::streamsize avail = egptr() - gptr();
+        if (avail == 0)
+        {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+            {
+                break;
+            }
+            continue;
+        }
+
+        std::streamsize count = std::min(avail, n - got);
+        std::memcpy(s + got, gptr(), count);
+        setg(eback(), gptr() + count, egptr());
+        got += count;
+    }
+    return got;
+}
+
+auto BodyStreambuf::showmanyc() -> std::streamsize
 {
     std::unique_lock<std::mutex> lock(mtx);
+    if (queued > 0)
+    {
+        return queued;
+    }
+    return finished ? -1 : 0;
+}
 
-    // 等待直到有足够的空间写入数据
-    cv.wait(lock, [this, length]() { return length <= getCapacity() - available(); });
+auto BodyStreambuf::push(ReadBuffer *buf, const char *data, size_t size)
+    -> size_t
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (abandoned || finished)
+    {
+        return 0;
+    }
+    if (size > 0)
+    {
+        // 同一次读取的多个数据块引用同一个缓冲区, 只计一次.
+        // 小块很多时引用的缓冲区远大于数据本身, 按缓冲区大小计才能限制内存
+        size_t cost =
+            !chunks.empty() && chunks.back().buf == buf ? 0 : buf->size;
+        buf->ref();
+        chunks.push_back({buf, data, size, cost});
+        queued += size;
+        pinned += cost;
+        cv.notify_one();
+    }
+    return pinned;
+}
 
-    // 写入数据到缓冲区
-    ReaderStreambuf::write(data, length);
+void BodyStreambuf::finish()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    finished = true;
+    cv.notify_all();
+}
 
-    // 通知读取端有数据可用
+void BodyStreambuf::abort()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!finished)
+    {
+        finished = true;
+        truncated = true;
+    }
     cv.notify_all();
 }
+
+auto BodyStreambuf::wait(size_t lowwater, void (*cb)(void *), void *arg)
+    -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (abandoned || pinned <= lowwater)
+    {
+        return false;
+    }
+    this->lowwater = lowwater;
+    this->drained = cb;
+    this->arg = arg;
+    return true;
+}
+
+auto BodyStreambuf::abandon() -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    abandoned = true;
+    release();
+    bool waiting = drained != nullptr;
+    drained = nullptr;
+    return waiting;
+}
+
+void BodyStreambuf::reset()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    release();
+    finished = false;
+    truncated = false;
+    abandoned = false;
+    drained = nullptr;
+    arg = nullptr;
+}
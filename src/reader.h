@@ -1,49 +1,155 @@
 #pragma once
 
-#include <streambuf>
-#include <vector>
-#include <stdexcept>
-#include <mutex>
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <streambuf>
+
+class ReadBufferPool;
+
+// 引用计数的读缓冲区, 数据紧跟在头部之后.
+// 请求体直接引用其中的数据, 所有引用释放后才回收, 来自缓冲区池的回到池中
+struct ReadBuffer
+{
+    std::atomic<unsigned int> refs;
+    size_t size;
+    ReadBufferPool *pool;
+    // 在缓冲区池的空闲链表中时指向下一个
+    ReadBuffer *next;
+
+    // 分配失败时返回 nullptr, 返回的缓冲区持有一个引用
+    static auto create(size_t size, ReadBufferPool *pool = nullptr)
+        -> ReadBuffer *;
+    // 由 data() 返回的指针找回缓冲区
+    static auto of(char *data) -> ReadBuffer *;
+
+    auto data() -> char * { return reinterpret_cast<char *>(this + 1); }
+    void ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref();
+};
 
-class ReaderStreambuf : public std::streambuf
+// 事件循环的读缓冲区池, 缓冲区大小相同, 最多留着 capacity 个空闲的.
+// acquire 只在事件循环线程上调用, 最后一个引用可能在 handler 线程上释放,
+// 所以空闲链表由锁保护
+class ReadBufferPool
 {
 private:
-    std::vector<char> buffer;   // 环形缓冲区
-    size_t capacity;            // 缓冲区容量
-    size_t head = 0;            // 写指针
-    size_t tail = 0;            // 读指针
-    size_t data_size = 0;       // 当前缓冲区中的数据量
+    std::mutex mtx;
+    ReadBuffer *idle = nullptr;
+    size_t count = 0;
+    // 属于这个池的缓冲区数, 包括空闲的
+    size_t allocated = 0;
+    bool closed = false;
 
-protected:
-    void updatePointers();
-    auto underflow() -> int override;
+    size_t bufsize;
+    size_t capacity;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    void drain();
 
 public:
-    explicit ReaderStreambuf(size_t buffer_size)
-        : buffer(buffer_size), capacity(buffer_size) {}
+    ReadBufferPool(size_t bufsize, size_t capacity)
+        : bufsize(bufsize), capacity(capacity) {}
 
-    void write(const char *data, size_t length);
+    // 取一个缓冲区, 池中没有空闲的时新分配, 分配失败时返回 nullptr
+    auto acquire() -> ReadBuffer *;
+    // 由 ReadBuffer::unref 调用
+    void release(ReadBuffer *buf);
+    // 修改缓冲区大小和空闲上限, 已有的空闲缓冲区被释放
+    void configure(size_t bufsize, size_t capacity);
+    // 释放空闲的缓冲区, 之后归还的缓冲区直接释放, 全部归还后删除池本身.
+    // 关闭后 acquire 分配不属于池的缓冲区
+    void close();
 
-    auto available() const -> size_t { return data_size; }
-    auto getCapacity() const -> size_t { return capacity; }
+    auto bufferSize() const -> size_t { return bufsize; }
+    auto hitCount() const -> uint64_t
+    {
+        return hits.load(std::memory_order_relaxed);
+    }
+    auto missCount() const -> uint64_t
+    {
+        return misses.load(std::memory_order_relaxed);
+    }
+    auto cached() -> size_t;
 };
 
-
-class ThreadSafeReaderStreambuf : public ReaderStreambuf
+// 请求体, 事件循环线程把读缓冲区中的数据块追加进来, handler 线程按块读取.
+// 追加时不拷贝也不阻塞, 积压由调用方暂停读取来限制. 积压按数据块引用的
+// 读缓冲区计算, 每引用一个新的缓冲区计入它的整个大小, 而不只是数据块的字节数.
+// Content-Length 和 chunked 的请求体都在 llhttp 解析完整个请求时结束
+class BodyStreambuf : public std::streambuf
 {
 private:
-    size_t remaining_size = 0;  // 剩余需要读取的数据量
+    struct chunk_s
+    {
+        ReadBuffer *buf;
+        const char *data;
+        size_t size;
+        // 计入 pinned 的字节数, 引用新缓冲区的块为缓冲区大小, 否则为 0
+        size_t cost;
+    };
+
     std::mutex mtx;
     std::condition_variable cv;
+    std::deque<chunk_s> chunks;
+    // 正在读取的块所在的缓冲区, get 区域指向它的数据
+    ReadBuffer *current = nullptr;
+    // chunks 中还没读取的字节数
+    size_t queued = 0;
+    // chunks 引用的读缓冲区的总大小, 用于限制积压
+    size_t pinned = 0;
+    // 请求体已全部到达或连接已关闭
+    bool finished = false;
+    // 连接在请求体结束前关闭
+    bool truncated = false;
+    // handler 已结束, 丢弃后续的数据
+    bool abandoned = false;
+
+    // pinned 降到 lowwater 及以下时调用一次 drained, 通知事件循环继续读取
+    size_t lowwater = 0;
+    void (*drained)(void *arg) = nullptr;
+    void *arg = nullptr;
+
+    void release();
 
 protected:
-    auto underflow() -> int override;
+    auto underflow() -> int_type override;
+    auto xsgetn(char *s, std::streamsize n) -> std::streamsize override;
+    auto showmanyc() -> std::streamsize override;
 
 public:
-    explicit ThreadSafeReaderStreambuf(size_t buffer_size)
-        : ReaderStreambuf(buffer_size) {}
+    BodyStreambuf() = default;
+    ~BodyStreambuf() override;
 
-    void write(const char *data, size_t length);
-    void setRemainingSize(size_t remaining_size);
+    // 以下在事件循环线程上调用
+
+    // 追加一块数据并持有 buf 的引用, 返回积压引用的缓冲区字节数
+    auto push(ReadBuffer *buf, const char *data, size_t size) -> size_t;
+    // 请求体结束, 读完积压的数据后返回 EOF
+    void finish();
+    // 请求体没有完整到达, 读完积压的数据后抛出异常, istream 会设置 badbit
+    void abort();
+    // 积压引用的缓冲区字节数降到 lowwater 及以下时调用 cb(arg),
+    // 已经不超过 lowwater 时返回 false
+    auto wait(size_t lowwater, void (*cb)(void *), void *arg) -> bool;
+    // handler 已结束, 丢弃积压和后续的数据, 返回是否取消了 wait
+    auto abandon() -> bool;
+    // 清空, 供下一个请求复用
+    void reset();
+};
+
+// 在一段连续内存上的只读流, 不拷贝数据
+class SpanStreambuf : public std::streambuf
+{
+public:
+    void reset(const char *data, size_t size)
+    {
+        char *p = const_cast<char *>(data);
+        setg(p, p, p + size);
+    }
 };
@@ -1,14 +1,25 @@
 #include "router.h"
+#include "llhttp.h"
+#include "tracer.h"
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 enum NodeType
 {
     Static,
     Root,
     Param,
+    CatchAll,
 };
 
 struct node
@@ -19,14 +30,102 @@ struct node
     bool wildChild;
     std::vector<node *> children;
     HandlerChain handler;
+    Execution execution = Execution::ThreadPool;
+    BodyMode body = BodyMode::Stream;
 
-    void addRoute(std::string path, HandlerChain handler);
+    void addRoute(std::string path, HandlerChain handler, Execution execution,
+                  BodyMode body);
     void insertChild(std::string path, std::string fullPath,
-                     HandlerChain handler);
-    // Recursively finds the node value or returns trailing slash recommendation
-    auto getValue(std::string path, Params *params, bool &tsr) -> HandlerChain;
+                     HandlerChain handler, Execution execution, BodyMode body);
+};
+
+// node 在 FrozenTree 中的紧凑形式, 32 字节
+struct flatnode
+{
+    // 指向原 node 的 handler, 没有 handler 时为 nullptr
+    const HandlerChain *handler;
+    // 第一个子节点在 nodes 中的下标, 子节点相邻存放
+    uint32_t children;
+    // indices 在 chars 中的偏移
+    uint32_t indices;
+    // 不超过 8 字节的路径直接存放, 更长的存放在 chars 中
+    union
+    {
+        char inlined[8];
+        uint32_t offset;
+    };
+    uint16_t len;
+    uint16_t nchildren;
+    uint16_t nindices;
+    uint8_t type : 2;
+    uint8_t wildChild : 1;
+    uint8_t execution : 2;
+    uint8_t body : 1;
+};
+
+// 注册的路由, 按编号存放
+struct RouteName
+{
+    std::string method;
+    std::string path;
+};
+
+// 注册完成后由路由树编译出的只读表, 节点按广度优先顺序存放在连续的数组中,
+// 多个事件循环可以同时查找
+struct FrozenTree
+{
+    std::vector<flatnode> nodes;
+    // 较长的节点路径和所有 indices, 末尾留有 16 字节的填充
+    std::string chars;
+    // 各节点的路由编号, 和 nodes 一一对应, 没有 handler 的节点为 -1
+    std::vector<int> ids;
+
+    // 有 handler 的节点依次编号, 完整路径追加到 names
+    void build(const node *root, std::string_view method,
+               std::vector<RouteName> &names);
+    auto pathOf(const flatnode &n) const -> std::string_view;
+    // Finds the node value or returns trailing slash recommendation
+    auto getValue(std::string_view path, Params *params, bool &tsr) const
+        -> const flatnode *;
+};
+
+struct FrozenRoutes
+{
+    std::array<FrozenTree *, MethodCount> trees{};
+    std::vector<RouteName> names;
+
+    ~FrozenRoutes()
+    {
+        for (auto *tree : trees)
+        {
+            delete tree;
+        }
+    }
 };
 
+#define XX(num, name, string)                                                  \
+    static_assert(num < MethodCount, "llhttp method out of range");
+HTTP_METHOD_MAP(XX)
+#undef XX
+
+auto methodIndex(std::string_view method) -> int
+{
+#define XX(num, name, string)                                                  \
+    if (method == #string)                                                     \
+    {                                                                          \
+        return num;                                                            \
+    }
+    HTTP_METHOD_MAP(XX)
+#undef XX
+    return -1;
+}
+
+// 请求的方法编号, 没有 method_id 时按方法名查找
+auto requestMethod(const request_s &req) -> int
+{
+    return req.method_id >= 0 ? req.method_id : methodIndex(req.method);
+}
+
 // Helper function to find the longest common prefix
 auto longestCommonPrefix(const std::string &a, const std::string &b) -> int
 {
@@ -43,8 +142,8 @@ auto findWildcard(const std::string &path, std::string &wildcard,
     for (int i = 0; i < path.size(); ++i)
     {
         char c = path[i];
-        if (c != ':')
-            continue; // Ignore anything other than ":"
+        if (c != ':' && c != '*')
+            continue; // Ignore anything other than ":" and "*"
 
         bool valid = true;
         for (int j = i + 1; j < path.size(); ++j)
@@ -70,11 +169,37 @@ auto findWildcard(const std::string &path, std::string &wildcard,
     return false;
 }
 
-auto cleanPath(const std::string &p) -> std::string
+// 路径以 / 开头且不含 //, /./, /../ 和结尾的 /. 或 /.. 时 cleanPath 不会修改它
+auto isCleanPath(std::string_view p) -> bool
 {
-    const size_t stackBufSize = 128;
-    std::vector<char> buf(stackBufSize);
+    if (p.empty() || p[0] != '/')
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < p.size();)
+    {
+        // p[i] 是 /, 取出到下一个 / 之前的一段
+        size_t next = p.find('/', i + 1);
+        auto segment = p.substr(i + 1, next == std::string_view::npos
+                                           ? std::string_view::npos
+                                           : next - i - 1);
+        if (segment == "." || segment == ".." ||
+            (segment.empty() && next != std::string_view::npos))
+        {
+            return false;
+        }
+        if (next == std::string_view::npos)
+        {
+            break;
+        }
+        i = next;
+    }
+    return true;
+}
 
+auto cleanPath(const std::string &p) -> std::string
+{
     if (p.size() == 0)
     {
         return "/";
@@ -82,27 +207,19 @@ auto cleanPath(const std::string &p) -> std::string
 
     size_t n = p.size();
 
-    size_t r = 1, w = 1;
+    // 结果不会比 p 长, p 不以 / 开头时多出开头的 /
+    std::string buf(n + 1, '\0');
+    buf[0] = '/';
 
-    // 将p的内容复制到buf中
-    for (int i = 0; i < std::min(stackBufSize, n); i++)
-    {
-        buf[i] = p[i];
-    }
-
-    if (p[0] != '/')
-    {
-        r = 0;
-        buf.resize(n + 1);
-        buf[0] = '/';
-    }
+    size_t r = p[0] == '/' ? 1 : 0, w = 1;
 
     bool trailing = n > 1 && p[n - 1] == '/';
 
-    for (; r < n; r++)
+    while (r < n)
     {
         if (p[r] == '/')
         {
+            // 空段, 如 //
             r++;
         }
         else if (p[r] == '.' && r + 1 == n)
@@ -112,32 +229,24 @@ auto cleanPath(const std::string &p) -> std::string
         }
         else if (p[r] == '.' && p[r + 1] == '/')
         {
-            if (r + 2 == n || p[r + 2] == '/')
+            // . 段
+            r += 2;
+        }
+        else if (p[r] == '.' && p[r + 1] == '.' &&
+                 (r + 2 == n || p[r + 2] == '/'))
+        {
+            // .. 段, 回退到上一个 /
+            r += 3;
+            if (w > 1)
             {
-                r += 3;
-                if (w > 1)
-                {
+                w--;
+                for (; w > 1 && buf[w] != '/';)
                     w--;
-
-                    if (buf.size() == 0)
-                    {
-                        for (; w > 1 && p[w] != '/';)
-                            w--;
-                    }
-                    else
-                    {
-                        for (; w > 1 && buf[w] != '/';)
-                            w--;
-                    }
-                }
-            }
-            else
-            {
-                r += 2;
             }
         }
         else
         {
+            // 普通的段, 前面补上 /
             if (w > 1)
             {
                 buf[w] = '/';
@@ -157,32 +266,52 @@ auto cleanPath(const std::string &p) -> std::string
         w++;
     }
 
-    if (buf.size() == 0)
-    {
-        return {buf.begin(), buf.begin() + w};
-    }
-
-    return {buf.begin(), buf.begin() + w};
+    buf.resize(w);
+    return buf;
 }
 
 auto RouterGroup::group(std::string relativePath) -> RouterGroup *
 {
     return new RouterGroup(calculateAbsolutePath(relativePath), handlers,
-                           engine);
+                           engine, execution, bodyMode);
 }
 
 void RouterGroup::handle(const std::string &method, const std::string &path,
                          RouteHandler handler)
 {
-    if (engine->trees.find(method) == engine->trees.end())
+    handle(method, path, std::move(handler), execution, bodyMode);
+}
+
+void RouterGroup::handle(const std::string &method, const std::string &path,
+                         RouteHandler handler, Execution execution)
+{
+    handle(method, path, std::move(handler), execution, bodyMode);
+}
+
+void RouterGroup::handle(const std::string &method, const std::string &path,
+                         RouteHandler handler, Execution execution,
+                         BodyMode body)
+{
+    int index = methodIndex(method);
+    if (index < 0)
+    {
+        throw std::runtime_error("Unknown method: " + method);
+    }
+    // 编译后的路由表可能正被事件循环读取, 不能再修改
+    if (engine->frozen != nullptr)
     {
-        engine->trees[method] = new node();
+        throw std::runtime_error("Routes are frozen, cannot add: " + path);
     }
-    node *root = engine->trees[method];
+    if (engine->trees[index] == nullptr)
+    {
+        engine->trees[index] = new node();
+    }
+    node *root = engine->trees[index];
     // TODO: Add route to the tree
     root->addRoute(calculateAbsolutePath(path),
-                   combineHandlers([handler](Context *ctx)
-                                   { handler(ctx->getRequest(), ctx->getResponse(), ctx); }));
+                   combineHandlers([handler = std::move(handler)](Context *ctx)
+                                   { handler(ctx->getRequest(), ctx->getResponse(), ctx); }),
+                   execution, body);
 }
 
 void RouterGroup::use(Handler handler) { handlers.push_back(handler); }
@@ -196,8 +325,10 @@ auto RouterGroup::calculateAbsolutePath(const std::string &relativePath)
 auto RouterGroup::combineHandlers(Handler handler) -> HandlerChain
 {
     // 将当前的handlers复制, 然后加上engine的handlers
-    HandlerChain combined = handlers;
-    combined.push_back(handler);
+    HandlerChain combined;
+    combined.reserve(handlers.size() + 1);
+    combined.insert(combined.end(), handlers.begin(), handlers.end());
+    combined.push_back(std::move(handler));
     return combined;
 }
 
@@ -230,72 +361,321 @@ auto RouterGroup::combineHandlers(Handler handler) -> HandlerChain
 //     }
 // }
 
+Engine::Engine()
+    : RouterGroup("", {}, this, Execution::ThreadPool, BodyMode::Stream)
+{
+    notfound = {[](Context *ctx)
+                {
+                    ctx->getResponse()
+                        ->setStatus(404)
+                        ->addHeader("Content-Type", "text/plain")
+                        ->setBody("404 Not Found");
+                }};
+
+    // 405 很少见, Allow 在响应时重新计算, 不用在匹配时保存
+    notallowed = {[this](Context *ctx)
+                  {
+                      auto *req = ctx->getRequest();
+                      auto path = cleanPath(
+                          std::string(req->url.substr(0, req->url.find('?'))));
+                      ctx->getResponse()
+                          ->setStatus(405)
+                          ->addHeader("Allow",
+                                      allowedMethods(path, requestMethod(*req)))
+                          ->addHeader("Content-Type", "text/plain")
+                          ->setBody("405 Method Not Allowed");
+                  }};
+}
+
+Engine::~Engine() { delete frozen; }
+
+void Engine::freeze()
+{
+    // 其它事件循环可能正在查找, 已编译的表不能替换
+    if (frozen != nullptr)
+    {
+        return;
+    }
+    // 编译失败时抛出异常, 不留下编译了一半的表
+    auto routes = std::make_unique<FrozenRoutes>();
+    for (int i = 0; i < MethodCount; i++)
+    {
+        if (trees[i] != nullptr)
+        {
+            routes->trees[i] = new FrozenTree();
+            routes->trees[i]->build(
+                trees[i], llhttp_method_name(static_cast<llhttp_method_t>(i)),
+                routes->names);
+        }
+    }
+    frozen = routes.release();
+}
+
+auto Engine::routeCount() const -> size_t
+{
+    return frozen != nullptr ? frozen->names.size() : 0;
+}
+
+auto Engine::routeName(int id, std::string_view &method,
+                       std::string_view &path) const -> bool
+{
+    if (frozen == nullptr || id < 0 || static_cast<size_t>(id) >= frozen->names.size())
+    {
+        return false;
+    }
+    method = frozen->names[id].method;
+    path = frozen->names[id].path;
+    return true;
+}
+
+// 不经过 listen 的单线程用法, 第一次调用时编译路由表
 void Engine::ServeHTTP(request_s &req, response_s &res)
 {
-    auto method = req.method;
-    auto path = req.url;
+    freeze();
+    Route route;
+    match(req, route);
+    ServeHTTP(req, res, route);
+}
 
-    if (trees.find(method) == trees.end())
+void Engine::match(request_s &req, Route &route)
+{
+    int method = requestMethod(req);
+    // 查询参数不参与路由匹配, 路径已经是规范形式时不用 cleanPath 重新构造
+    auto path = req.url.substr(0, req.url.find('?'));
+    if (isCleanPath(path))
     {
-        throw std::runtime_error("Method " + method + " not allowed");
+        route.path.assign(path);
     }
+    else
+    {
+        route.path = cleanPath(std::string(path));
+    }
+
+    assert(frozen != nullptr && "Engine::freeze must run before match");
 
-    auto cleanedPath = cleanPath(path);
+    if (method >= 0 && frozen->trees[method] != nullptr)
+    {
+    redirect:
+        FrozenTree *root = frozen->trees[method];
+        bool tsr = false;
+        auto *value = root->getValue(route.path, &route.params, tsr);
 
-redirect:
-    node *root = trees[method];
-    Params params;
-    bool tsr = false;
-    HandlerChain handler = root->getValue(cleanedPath, &params, tsr);
+        if (value != nullptr)
+        {
+            route.handlers = value->handler;
+            route.id = root->ids[value - root->nodes.data()];
+            route.execution = static_cast<Execution>(value->execution);
+            route.body = static_cast<BodyMode>(value->body);
+            return;
+        }
+        else if (tsr)
+        {
+            // printf("Redirect to: %s/\n", path.c_str());
+            route.path += "/";
+            route.params.clear();
+            goto redirect;
+        }
+    }
 
-    if (handler.size() > 0)
+    if (!allowedMethods(route.path, method).empty())
     {
-        Context ctx(&req, &res, params, handler);
-        ctx.next();
+        route.handlers = &notallowed;
+        route.execution = Execution::Inline;
+        return;
     }
-    else if (tsr)
+
+    // printf("404 Not Found: %s\n", path.c_str());
+    if (!noroute.empty())
     {
-        // printf("Redirect to: %s/\n", path.c_str());
-        cleanedPath += "/";
-        goto redirect;
+        route.handlers = &noroute;
+        route.execution = execution;
+        route.body = bodyMode;
     }
     else
     {
-        // printf("404 Not Found: %s\n", path.c_str());
-        if (noroute != nullptr)
+        route.handlers = &notfound;
+        route.execution = Execution::Inline;
+    }
+}
+
+auto Engine::allowedMethods(std::string_view path,
+                            int method) -> std::string
+{
+    std::string allow;
+    for (int i = 0; i < MethodCount; i++)
+    {
+        if (i == method || frozen->trees[i] == nullptr)
         {
-            Context ctx(&req, &res, params, {noroute});
-            ctx.next();
+            continue;
         }
-        else
+
+        Params params;
+        bool tsr = false;
+        if (frozen->trees[i]->getValue(path, &params, tsr) != nullptr)
         {
-            res.setStatus(404)
-                ->addHeader("Content-Type", "text/plain")
-                ->setBody("404 Not Found");
+            if (!allow.empty())
+            {
+                allow += ", ";
+            }
+            allow += llhttp_method_name(static_cast<llhttp_method_t>(i));
         }
     }
+    return allow;
+}
+
+void Engine::ServeHTTP(request_s &req, response_s &res, Route &route)
+{
+    Context ctx(&req, &res, &route.params, route.handlers);
+    Tracer *tracer = this->tracer.load(std::memory_order_acquire);
+    if (tracer != nullptr && tracer->sample(ctx.request))
+    {
+        ctx.tracer = tracer;
+        ctx.route = route.id;
+        uint64_t begin = traceClock();
+        ctx.next();
+        tracer->span(ctx.request, route.id, -1, false, begin, traceClock());
+        return;
+    }
+    ctx.next();
+}
+
+void Engine::setTracer(Tracer *tracer)
+{
+    if (tracer != nullptr)
+    {
+        tracer->bind(this);
+    }
+    this->tracer.store(tracer, std::memory_order_release);
 }
 
 void Engine::NoRoute(RouteHandler handler)
 {
-    noroute = [handler](Context *ctx)
+    noroute = {[handler](Context *ctx)
+               { handler(ctx->getRequest(), ctx->getResponse(), ctx); }};
+}
+
+// Finds the first child whose index byte is c. chars is padded with 16
+// bytes so the SSE2 path can always load a full block
+auto findIndex(const char *indices, size_t n, char c) -> int
+{
+    // 大部分节点只有几个子节点, 直接比较更快
+    if (n <= 4)
     {
-        handler(ctx->getRequest(), ctx->getResponse(), ctx);
-    };
+        for (size_t i = 0; i < n; i++)
+        {
+            if (indices[i] == c)
+            {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+    __m128i needle = _mm_set1_epi8(c);
+    for (size_t i = 0; i < n; i += 16)
+    {
+        __m128i block =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(indices + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (n - i < 16)
+        {
+            mask &= (1u << (n - i)) - 1;
+        }
+        if (mask != 0)
+        {
+            return static_cast<int>(i) + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+#else
+    auto *p = static_cast<const char *>(std::memchr(indices, c, n));
+    return p != nullptr ? static_cast<int>(p - indices) : -1;
+#endif
+}
+
+void FrozenTree::build(const node *root, std::string_view method,
+                       std::vector<RouteName> &names)
+{
+    // Breadth-first, so the children of every node end up next to each other
+    std::vector<const node *> order = {root};
+    // Full path of every node in order, used to name the routes
+    std::vector<std::string> paths = {root->path};
+    nodes.resize(1);
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const node *n = order[i];
+        if (!n->handler.empty())
+        {
+            ids.push_back(static_cast<int>(names.size()));
+            names.push_back({std::string(method), paths[i]});
+        }
+        else
+        {
+            ids.push_back(-1);
+        }
+
+        // 紧凑节点用 16 位存放长度和数量, 32 位存放 chars 中的位置,
+        // 放不下时不能截断
+        if (n->path.size() > UINT16_MAX || n->children.size() > UINT16_MAX ||
+            n->indices.size() > UINT16_MAX ||
+            chars.size() + n->path.size() > UINT32_MAX)
+        {
+            throw std::runtime_error("Route node too large to freeze: " +
+                                     paths[i]);
+        }
+
+        flatnode f{};
+        f.handler = n->handler.empty() ? nullptr : &n->handler;
+        f.children = static_cast<uint32_t>(order.size());
+        f.nchildren = static_cast<uint16_t>(n->children.size());
+        f.nindices = static_cast<uint16_t>(n->indices.size());
+        f.type = n->type;
+        f.wildChild = n->wildChild;
+        f.execution = static_cast<uint8_t>(n->execution);
+        f.body = static_cast<uint8_t>(n->body);
+
+        f.len = static_cast<uint16_t>(n->path.size());
+        if (n->path.size() <= sizeof(f.inlined))
+        {
+            std::memcpy(f.inlined, n->path.data(), n->path.size());
+        }
+        else
+        {
+            f.offset = static_cast<uint32_t>(chars.size());
+            chars += n->path;
+        }
+        f.indices = static_cast<uint32_t>(chars.size());
+        chars += n->indices;
+
+        nodes[i] = f;
+        for (const node *child : n->children)
+        {
+            order.push_back(child);
+            paths.push_back(paths[i] + child->path);
+        }
+        nodes.resize(order.size());
+    }
+    chars.append(16, '\0');
+}
+
+auto FrozenTree::pathOf(const flatnode &n) const -> std::string_view
+{
+    return n.len <= sizeof(n.inlined) ? std::string_view(n.inlined, n.len)
+                                      : std::string_view(&chars[n.offset], n.len);
 }
 
 // Method to walk through the tree and find the handle or trailing slash
 // recommendation
-auto node::getValue(std::string path, Params *params,
-                    bool &tsr) -> HandlerChain
+auto FrozenTree::getValue(std::string_view path, Params *params,
+                          bool &tsr) const -> const flatnode *
 {
-    auto n = this;
-    std::string prefix;
+    const flatnode *n = &nodes[0];
+    std::string_view prefix;
 
-walk_tree:
     while (true)
     {
-        prefix = n->path;
+        prefix = pathOf(*n);
 
         if (path.size() > prefix.size())
         {
@@ -307,23 +687,20 @@ walk_tree:
                 // No wildcard child
                 if (!n->wildChild)
                 {
-                    char idxc = path[0];
-                    for (size_t i = 0; i < n->indices.size(); ++i)
+                    int i = findIndex(&chars[n->indices], n->nindices, path[0]);
+                    if (i >= 0)
                     {
-                        if (n->indices[i] == idxc)
-                        {
-                            n = n->children[i];
-                            goto walk_tree;
-                        }
+                        n = &nodes[n->children + i];
+                        continue;
                     }
 
                     // No match found, check for trailing slash recommendation
-                    tsr = (path == "/" && n->handler.size() > 0);
-                    return {};
+                    tsr = (path == "/" && n->handler != nullptr);
+                    return nullptr;
                 }
 
                 // Handle wildcard child
-                n = n->children[0];
+                n = &nodes[n->children];
                 switch (n->type)
                 {
                 case Param:
@@ -334,45 +711,49 @@ walk_tree:
                         end++;
                     }
 
-                    // Save param value into unordered_map
+                    // Save param value, both views stay valid after the walk
                     if (params)
                     {
-                        params->emplace(n->path.substr(1), path.substr(0, end));
+                        params->add(pathOf(*n).substr(1), path.substr(0, end));
                     }
 
                     if (end < path.size())
                     {
-                        if (!n->children.empty())
+                        if (n->nchildren > 0)
                         {
                             path = path.substr(end);
-                            n = n->children[0];
-                            goto walk_tree;
+                            n = &nodes[n->children];
+                            continue;
                         }
 
                         // No deeper path to follow, recommend TSR
                         tsr = (path.size() == end + 1);
-                        return {};
+                        return nullptr;
                     }
 
-                    if (n->handler.size() > 0)
+                    if (n->handler != nullptr)
                     {
-                        return n->handler;
+                        return n;
                     }
-                    else if (n->children.size() == 1)
+                    else if (n->nchildren == 1)
                     {
-                        n = n->children[0];
-                        tsr = (n->path == "/" && n->handler.size() > 0) ||
-                              (n->path.empty() && n->indices == "/");
+                        n = &nodes[n->children];
+                        tsr = (pathOf(*n) == "/" && n->handler != nullptr) ||
+                              (n->len == 0 && n->nindices == 1 &&
+                               chars[n->indices] == '/');
                     }
-                    return {};
+                    return nullptr;
                 }
 
-                    // case CatchAll:
-                    //     // Save param value into unordered_map for catch-all
-                    //     if (params) {
-                    //         params->emplace(n->path.substr(2), path);
-                    //     }
-                    //     return n->handle;
+                case CatchAll:
+                {
+                    // Save the rest of the path, including the leading '/'
+                    if (params)
+                    {
+                        params->add(pathOf(*n).substr(2), path);
+                    }
+                    return n;
+                }
 
                 default:
                     throw std::runtime_error("Invalid node type");
@@ -382,56 +763,62 @@ walk_tree:
         else if (path == prefix)
         {
             // If the path exactly matches this node
-            if (n->handler.size() > 0)
+            if (n->handler != nullptr)
             {
-                return n->handler;
+                return n;
             }
 
             // No handle for this route, check for wildcard child
             if (path == "/" && n->wildChild && n->type != Root)
             {
                 tsr = true;
-                return {};
+                return nullptr;
             }
 
             if (path == "/" && n->type == Static)
             {
                 tsr = true;
-                return {};
+                return nullptr;
             }
 
             // Check for trailing slash by looking through indices
-            for (size_t i = 0; i < n->indices.size(); ++i)
+            int i = findIndex(&chars[n->indices], n->nindices, '/');
+            if (i >= 0)
             {
-                if (n->indices[i] == '/')
-                {
-                    n = n->children[i];
-                    tsr = (n->path.size() == 1 && n->handler.size() > 0) ||
-                          (n->children[0]->handler.size() > 0);
-                    return {};
-                }
+                n = &nodes[n->children + i];
+                tsr = (n->len == 1 && n->handler != nullptr) ||
+                      (n->nchildren > 0 &&
+                       nodes[n->children].handler != nullptr);
             }
-            return {};
+            return nullptr;
         }
 
         // No match, check for trailing slash redirection
         tsr = (path == "/" || (prefix.size() == path.size() + 1 &&
                                prefix[path.size()] == '/' &&
                                path == prefix.substr(0, prefix.size() - 1) &&
-                               n->handler.size() > 0));
-        return {};
+                               n->handler != nullptr));
+        return nullptr;
     }
 }
 
-void node::addRoute(std::string path, HandlerChain handler)
+void node::addRoute(std::string path, HandlerChain handler,
+                    Execution execution, BodyMode body)
 {
     node *n = this;
     std::string fullPath = path;
 
+    if (static_cast<size_t>(std::count(path.begin(), path.end(), ':') +
+                            std::count(path.begin(), path.end(), '*')) >
+        MaxParams)
+    {
+        throw std::runtime_error("Too many parameters in path: " + fullPath);
+    }
+
     // Case 1: Empty tree, root initialization
     if (n->path.empty() && n->indices.empty())
     {
-        n->insertChild(path, fullPath, handler);
+        n->insertChild(path, fullPath, handler, execution, body);
         type = Root;
         return;
     }
@@ -449,7 +836,9 @@ void node::addRoute(std::string path, HandlerChain handler)
                                    Static,
                                    n->wildChild,
                                    n->children,
-                                   n->handler};
+                                   n->handler,
+                                   n->execution,
+                                   n->body};
             n->children = {child};
             n->indices = n->path[commonPrefixLen];
             n->path = n->path.substr(0, commonPrefixLen);
@@ -464,8 +853,13 @@ void node::addRoute(std::string path, HandlerChain handler)
 
             if (n->wildChild)
             {
+                n = n->children[0];
+
+                // Check if the wildcard matches, a catch-all can't have
+                // children and :name must not be a prefix of :names
                 if (path.size() >= n->path.size() &&
                     n->path == path.substr(0, n->path.size()) &&
+                    n->type != CatchAll &&
                     (n->path.size() >= path.size() ||
                      path[n->path.size()] == '/'))
                 {
@@ -474,7 +868,8 @@ void node::addRoute(std::string path, HandlerChain handler)
                 else
                 {
                     throw std::runtime_error("Conflict: " + fullPath +
-                                             " with wildcard route.");
+                                             " with wildcard route '" +
+                                             n->path + "'.");
                 }
             }
 
@@ -497,16 +892,21 @@ void node::addRoute(std::string path, HandlerChain handler)
                     break;
                 }
             }
+            if (matched)
+            {
+                continue;
+            }
 
-            // Case 4: Create new child node if no match found
-            if (!matched)
+            // Case 4: Create new child node if no match found, wildcards
+            // are inserted into the current node
+            if (path[0] != ':' && path[0] != '*')
             {
                 n->indices += path[0];
                 node *child = new node();
                 n->children.push_back(child);
                 n = child;
             }
-            n->insertChild(path, fullPath, handler);
+            n->insertChild(path, fullPath, handler, execution, body);
             return;
         }
 
@@ -517,12 +917,15 @@ void node::addRoute(std::string path, HandlerChain handler)
                                      " with existing route.");
         }
         n->handler = handler;
+        n->execution = execution;
+        n->body = body;
         return;
     }
 }
 
 void node::insertChild(std::string path, std::string fullPath,
-                       HandlerChain handler)
+                       HandlerChain handler, Execution execution,
+                       BodyMode body)
 {
     node *n = this;
     while (true)
@@ -562,7 +965,7 @@ void node::insertChild(std::string path, std::string fullPath,
             }
 
             n->wildChild = true;
-            node *child = new node{wildcard, "", Param, true, {}, {}};
+            node *child = new node{wildcard, "", Param, false, {}, {}};
             n->children = {child};
             n = child;
 
@@ -576,35 +979,108 @@ void node::insertChild(std::string path, std::string fullPath,
             }
 
             n->handler = handler;
+            n->execution = execution;
+            n->body = body;
             return;
         }
+
+        // Handle the catch-all, it must be the last segment
+        if (pos + wildcard.size() != path.size())
+        {
+            throw std::runtime_error(
+                "Catch-all routes are only allowed at the end of the path '" +
+                fullPath + "'");
+        }
+
+        if (!n->path.empty() && n->path.back() == '/')
+        {
+            throw std::runtime_error("Catch-all conflicts with existing "
+                                     "handle for the path segment root '" +
+                                     fullPath + "'");
+        }
+
+        if (pos == 0 || path[pos - 1] != '/')
+        {
+            throw std::runtime_error("No / before catch-all in path '" +
+                                     fullPath + "'");
+        }
+
+        // The '/' before '*' belongs to the catch-all, so it also matches
+        // the bare prefix with a trailing slash
+        pos--;
+        n->path = path.substr(0, pos);
+
+        // First node: catch-all node with empty path
+        node *child = new node{"", "", CatchAll, true, {}, {}};
+        n->children = {child};
+        n->indices = "/";
+        n = child;
+
+        // Second node: node holding the variable
+        child = new node{path.substr(pos), "", CatchAll, false, {}, handler,
+                         execution, body};
+        n->children = {child};
+        return;
     }
 
     // No wildcard found, set path and handler
     n->path = path;
     n->handler = handler;
+    n->execution = execution;
+    n->body = body;
 }
 
 void Context::next()
 {
     index++;
-    for (; index < handlerChain.size(); index++)
+    // 没有采样的请求只多这一次判断
+    if (tracer != nullptr)
     {
-        if (handlerChain[index])
+        traceNext();
+        return;
+    }
+    for (; index < handlerChain->size(); index++)
+    {
+        if ((*handlerChain)[index])
         {
-            handlerChain[index](this);
+            (*handlerChain)[index](this);
         }
     }
 }
 
-void Context::abort() { index = handlerChain.size() + 10; }
+// 和 next 相同, 但每次调用前后各取一次时间戳. 中间件在其中调用 next 时,
+// 后面的区间嵌套在它的区间之内
+void Context::traceNext()
+{
+    size_t size = handlerChain->size();
+    for (; index < size; index++)
+    {
+        if ((*handlerChain)[index])
+        {
+            size_t current = index;
+            uint64_t begin = traceClock();
+            (*handlerChain)[index](this);
+            tracer->span(request, route, static_cast<int>(current),
+                         current + 1 == size, begin, traceClock());
+        }
+    }
+}
+
+void Context::abort() { index = handlerChain->size() + 10; }
 
-auto Context::getParam(const std::string &key, std::string &param) -> bool
+auto Context::getParam(std::string_view key, std::string &param) -> bool
 {
-    if (params.find(key) != params.end())
+    auto *value = params->find(key);
+    if (value != nullptr)
     {
-        param = params[key];
+        param.assign(*value);
         return true;
     }
     return false;
 }
+
+auto Context::getParam(std::string_view key) -> std::string_view
+{
+    auto *value = params->find(key);
+    return value != nullptr ? *value : std::string_view();
+}
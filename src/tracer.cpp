@@ -0,0 +1,216 @@
+#include "tracer.h"
+#include "router.h"
+#include <algorithm>
+#include <cstdio>
+#include <uv.h>
+
+namespace
+{
+
+// 校准 TSC 至少需要的时间
+constexpr auto Calibration = std::chrono::milliseconds(10);
+
+void appendEscaped(std::string &out, std::string_view value)
+{
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            int len = snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out.append(buf, len);
+        }
+        else
+        {
+            out.push_back(c);
+        }
+    }
+}
+
+} // namespace
+
+Tracer::Tracer(unsigned int every, size_t capacity)
+    : capacity(ringCapacity(capacity)), every(std::max(every, 1u)),
+      clock0(traceClock()), time0(std::chrono::steady_clock::now())
+{
+}
+
+// 当前线程的缓冲区, 第一次写入时创建
+auto Tracer::local() -> thread_s *
+{
+    return threads.local(
+        [this](size_t index)
+        {
+            auto t = std::make_unique<thread_s>();
+            t->number = static_cast<unsigned int>(index) + 1;
+            t->spans = std::make_unique<span_s[]>(capacity);
+            return t;
+        });
+}
+
+auto Tracer::sample(uint64_t &request) -> bool
+{
+    thread_s *t = local();
+    if (t->countdown > 0)
+    {
+        t->countdown--;
+        return false;
+    }
+    t->countdown = every.load(std::memory_order_relaxed) - 1;
+    request = ++t->requests;
+    return true;
+}
+
+void Tracer::span(uint64_t request, int route, int index, bool last,
+                  uint64_t begin, uint64_t end)
+{
+    thread_s *t = local();
+    uint64_t head = t->head.load(std::memory_order_relaxed);
+    span_s &s = t->spans[head & (capacity - 1)];
+    // 先标记为正在写入, 栅栏保证导出线程读到新字段时也能看到这个标记
+    s.seq.store(head * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.begin.store(begin, std::memory_order_relaxed);
+    s.end.store(end, std::memory_order_relaxed);
+    s.request.store(request, std::memory_order_relaxed);
+    s.meta.store(static_cast<uint64_t>(static_cast<uint32_t>(route)) << 32 |
+                     static_cast<uint64_t>(index + 1) << 1 | (last ? 1 : 0),
+                 std::memory_order_relaxed);
+    s.seq.store(head * 2 + 2, std::memory_order_release);
+    t->head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::exportJSON(std::string &out)
+{
+    // 起点之后过得越久, TSC 的频率估计得越准
+    auto elapsed = std::chrono::steady_clock::now() - time0;
+    if (elapsed < Calibration)
+    {
+        std::this_thread::sleep_for(Calibration - elapsed);
+    }
+    uint64_t clock1 = traceClock();
+    double nanos = std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - time0)
+                       .count();
+    // 每微秒的时钟周期数
+    double perMicro = (clock1 - clock0) / nanos * 1000;
+
+    std::vector<thread_s *> snapshot = threads.snapshot();
+    Engine *names = engine.load();
+
+    out.append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    auto separator = [&out, &first]()
+    {
+        if (!first)
+        {
+            out.push_back(',');
+        }
+        first = false;
+    };
+
+    char buf[128];
+    for (thread_s *t : snapshot)
+    {
+        separator();
+        int len = snprintf(buf, sizeof(buf),
+                           "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                           "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                           t->number, t->number);
+        out.append(buf, len);
+
+        uint64_t head = t->head.load(std::memory_order_acquire);
+        uint64_t start = head > capacity ? head - capacity : 0;
+        for (uint64_t i = start; i < head; i++)
+        {
+            span_s &s = t->spans[i & (capacity - 1)];
+            uint64_t seq = s.seq.load(std::memory_order_acquire);
+            uint64_t b = s.begin.load(std::memory_order_relaxed);
+            uint64_t e = s.end.load(std::memory_order_relaxed);
+            uint64_t request = s.request.load(std::memory_order_relaxed);
+            uint64_t meta = s.meta.load(std::memory_order_relaxed);
+            // 字段的读取不能移到再次读取 seq 之后
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // 写入线程已经绕回来覆盖了这条记录, 或者在读取期间开始覆盖
+            if (seq != i * 2 + 2 ||
+                s.seq.load(std::memory_order_relaxed) != seq)
+            {
+                continue;
+            }
+
+            int route = static_cast<int32_t>(meta >> 32);
+            int index = static_cast<int>((meta >> 1) & 0x7fffffff) - 1;
+            bool last = meta & 1;
+            std::string_view method;
+            std::string_view path;
+            bool named = names != nullptr && names->routeName(route, method, path);
+
+            separator();
+            out.append("{\"name\":\"");
+            if (index < 0)
+            {
+                if (named)
+                {
+                    appendEscaped(out, method);
+                    out.push_back(' ');
+                    appendEscaped(out, path);
+                }
+                else
+                {
+                    out.append("unmatched");
+                }
+            }
+            else if (last)
+            {
+                out.append("handler");
+            }
+            else
+            {
+                len = snprintf(buf, sizeof(buf), "middleware %d", index);
+                out.append(buf, len);
+            }
+            out.append("\",\"cat\":\"");
+            out.append(index < 0 ? "request" : "handler");
+            len = snprintf(buf, sizeof(buf),
+                           "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                           "\"dur\":%.3f,\"args\":{\"request\":%llu}}",
+                           t->number, (b - clock0) / perMicro,
+                           (e - b) / perMicro,
+                           static_cast<unsigned long long>(request));
+            out.append(buf, len);
+        }
+    }
+    out.append("]}\n");
+}
+
+auto trace_open(Tracer **tracer, unsigned int every, size_t capacity) -> int
+{
+    *tracer = new Tracer(every, capacity);
+    return 0;
+}
+
+auto trace_sample(Tracer *tracer, unsigned int every) -> int
+{
+    if (every == 0)
+    {
+        return UV_EINVAL;
+    }
+    tracer->setSample(every);
+    return 0;
+}
+
+auto trace_export(Tracer *tracer, std::string &out) -> int
+{
+    tracer->exportJSON(out);
+    return 0;
+}
+
+void trace_close(Tracer *tracer)
+{
+    delete tracer;
+}
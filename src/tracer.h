@@ -0,0 +1,95 @@
+#pragma once
+
+#include "perthread.h"
+#include "tracing.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define GIN_TRACE_TSC 1
+#endif
+
+struct Engine;
+
+// 追踪用的时间戳. x86 上读取 TSC, 不经过系统调用也不做换算,
+// 导出时按 steady_clock 校准; 其它平台直接用 steady_clock 的纳秒数
+inline auto traceClock() -> uint64_t
+{
+#ifdef GIN_TRACE_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+class Tracer
+{
+private:
+    // 一个调用区间. 写入线程可能在导出时覆盖同一条记录, 各字段都是原子的,
+    // 由 seq 做顺序锁, 导出时丢弃读取期间被覆盖的记录
+    struct span_s
+    {
+        // 写入第 n 条记录时为 2n + 1, 写完后为 2n + 2
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> begin;
+        std::atomic<uint64_t> end;
+        // 线程内的请求序号, 同一请求的区间相同
+        std::atomic<uint64_t> request;
+        // 路由编号 << 32 | 在处理链中的位置 + 1 (0 表示整个请求) << 1 | 是否最后一个
+        std::atomic<uint64_t> meta;
+    };
+
+    struct thread_s
+    {
+        // 登记的顺序, 导出为 tid
+        unsigned int number;
+        std::unique_ptr<span_s[]> spans;
+        // 只由写入线程修改
+        std::atomic<uint64_t> head{0};
+        // 距离下一次采样还剩的请求数, 只由写入线程访问
+        unsigned int countdown = 0;
+        uint64_t requests = 0;
+    };
+
+    size_t capacity;
+    std::atomic<unsigned int> every;
+    // 路由名字的来源, 由 Engine::setTracer 设置
+    std::atomic<Engine *> engine{nullptr};
+
+    PerThread<thread_s> threads;
+
+    // 校准的起点
+    uint64_t clock0;
+    std::chrono::steady_clock::time_point time0;
+
+    auto local() -> thread_s *;
+
+public:
+    Tracer(unsigned int every, size_t capacity);
+
+    void bind(Engine *engine) { this->engine.store(engine); }
+    void setSample(unsigned int every) { this->every.store(every); }
+
+    // 以下在处理请求的线程上调用
+    // 是否记录这个请求, 记录时 request 是分配的序号
+    auto sample(uint64_t &request) -> bool;
+    // index 为 -1 表示整个请求
+    void span(uint64_t request, int route, int index, bool last,
+              uint64_t begin, uint64_t end);
+
+    void exportJSON(std::string &out);
+};
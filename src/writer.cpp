@@ -0,0 +1,194 @@
+#include "writer.h"
+#include <algorithm>
+#include <charconv>
+
+auto ResponseWriter::wakeup() -> bool
+{
+    if (!armed)
+    {
+        return false;
+    }
+    armed = false;
+    return true;
+}
+
+auto ResponseWriter::write(const char *data, size_t size) -> bool
+{
+    bool wake = false;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        // 对端接收得慢时在这里等待, 不在内存中堆积
+        cv.wait(lock, [this]() { return queued < highwater || closed; });
+        if (closed || ended)
+        {
+            return false;
+        }
+        started = true;
+        if (size == 0)
+        {
+            // 空块会被当作结束块
+            return true;
+        }
+
+        size_t before = out.size();
+        if (chunked)
+        {
+            char hex[2 * sizeof(size_t) + 2];
+            auto res = std::to_chars(hex, hex + sizeof(hex), size, 16);
+            out.append(hex, res.ptr);
+            out.append("\r\n", 2);
+            out.append(data, size);
+            out.append("\r\n", 2);
+        }
+        else
+        {
+            out.append(data, size);
+        }
+        queued += out.size() - before;
+
+        // 积攒到 FlushSize 再通知, 但不能超过 highwater, 否则会等不到写出
+        if (out.size() >= std::min(FlushSize, highwater))
+        {
+            wake = wakeup();
+        }
+    }
+
+    if (wake)
+    {
+        notify(arg);
+    }
+    return true;
+}
+
+auto ResponseWriter::flush() -> bool
+{
+    bool wake = false;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (closed)
+        {
+            return false;
+        }
+        started = true;
+        if (!out.empty())
+        {
+            wake = wakeup();
+        }
+    }
+
+    if (wake)
+    {
+        notify(arg);
+    }
+    return true;
+}
+
+void ResponseWriter::end()
+{
+    bool wake = false;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (closed || ended)
+        {
+            return;
+        }
+        started = true;
+        ended = true;
+        if (chunked)
+        {
+            out.append("0\r\n\r\n", 5);
+            queued += 5;
+        }
+        wake = wakeup();
+    }
+
+    if (wake)
+    {
+        notify(arg);
+    }
+}
+
+void ResponseWriter::start(bool chunked, size_t highwater, void (*cb)(void *),
+                           void *arg)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    this->chunked = chunked;
+    this->highwater = highwater;
+    this->notify = cb;
+    this->arg = arg;
+}
+
+auto ResponseWriter::arm() -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (ended || closed)
+    {
+        return false;
+    }
+    armed = true;
+    return true;
+}
+
+auto ResponseWriter::disarm() -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    bool was = armed;
+    armed = false;
+    return was;
+}
+
+auto ResponseWriter::take(std::string &data) -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    data.swap(out);
+    out.clear();
+    return ended;
+}
+
+void ResponseWriter::written(size_t size)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    queued -= size;
+    cv.notify_all();
+}
+
+void ResponseWriter::fail()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    ended = true;
+    failed = true;
+}
+
+auto ResponseWriter::isFailed() -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    return failed;
+}
+
+void ResponseWriter::close()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    closed = true;
+    cv.notify_all();
+}
+
+auto ResponseWriter::isStarted() -> bool
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    return started;
+}
+
+void ResponseWriter::reset()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    out.clear();
+    queued = 0;
+    chunked = true;
+    started = false;
+    ended = false;
+    closed = false;
+    failed = false;
+    armed = false;
+    notify = nullptr;
+    arg = nullptr;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "ctx.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+// 流式响应, handler 线程写入, 事件循环线程取走后写出.
+// 写入的数据按 chunked 编码追加到 out, 未写出的数据超过 highwater 时
+// handler 线程等待, 写出的速度由对端的接收速度决定
+class ResponseWriter : public response_stream_s
+{
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    // 等待事件循环取走的数据, 已按 chunked 编码
+    std::string out;
+    // out 加上正在写出的字节数
+    size_t queued = 0;
+    size_t highwater = 0;
+    // HTTP/1.0 不支持 chunked, 直接写出数据, 以关闭连接结束响应
+    bool chunked = true;
+    // handler 已开始写入, 之后修改的响应头不再生效
+    bool started = false;
+    // 已写入结束块, 不能再写入
+    bool ended = false;
+    // 连接已关闭, 写入直接返回 false
+    bool closed = false;
+    // handler 出错, 响应不完整
+    bool failed = false;
+
+    // 有数据时通知事件循环取走, 每次 arm 之后最多通知一次
+    bool armed = false;
+    void (*notify)(void *arg) = nullptr;
+    void *arg = nullptr;
+
+    // 持有锁时调用, 返回是否需要通知
+    auto wakeup() -> bool;
+
+public:
+    // 单次写入的数据少于这个值时先积攒, 到达后或 flush 时才通知事件循环
+    static constexpr size_t FlushSize = 16 * 1024;
+
+    // 以下在 handler 线程上调用
+
+    auto write(const char *data, size_t size) -> bool override;
+    auto flush() -> bool override;
+    void end() override;
+    void fail() override;
+    auto isStarted() -> bool override;
+
+    // 以下在事件循环线程上调用
+
+    // 执行 handler 之前调用, 之后 arm 一次
+    void start(bool chunked, size_t highwater, void (*cb)(void *), void *arg);
+    // 允许通知一次事件循环, 响应已结束时返回 false
+    auto arm() -> bool;
+    // 取消 arm, 返回之前是否已 arm
+    auto disarm() -> bool;
+    // 把等待写出的数据交换到 data 中, 返回响应是否已全部取走
+    auto take(std::string &data) -> bool;
+    // size 字节已写出, 唤醒等待的 handler
+    void written(size_t size);
+    // 连接已关闭
+    void close();
+    auto isFailed() -> bool;
+    auto isChunked() const -> bool { return chunked; }
+    void reset();
+};